@@ -0,0 +1,496 @@
+#ifndef COMPACTRBTREE_H_
+#define COMPACTRBTREE_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+// Positional red-black tree whose nodes live in one contiguous pool and link
+// to each other by 32-bit indices. A node costs 16 bytes plus the payload
+// (RBTree: 40 bytes plus malloc overhead), and indices stay valid when the
+// pool grows. Index 0 is the nil node; the color is the top bit of parent,
+// so at most 2^31 - 1 elements are supported. Iterators are invalidated only
+// by erasing the element they point to.
+
+template <class T> class CompactRBTree;
+
+namespace CompactRBTreeBase_ {
+
+struct Link_ {
+  uint32_t left, right, parent; // top bit of parent: red
+  uint32_t size; // 0 for nil and for free slots
+};
+
+template <class T> struct Node_ : Link_ {
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type raw;
+  T& value() { return *reinterpret_cast<T*>(&raw); }
+};
+
+template <class T, class Tree, class V> class Iterator_ {
+  Tree* tree_;
+  uint32_t idx_;
+  typedef Iterator_ Self_;
+  Iterator_(Tree* tree, uint32_t idx) : tree_(tree), idx_(idx) {}
+ public:
+  typedef T value_type;
+  typedef V& reference;
+  typedef V* pointer;
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef ptrdiff_t difference_type;
+
+  Iterator_() : tree_(nullptr), idx_(0) {}
+  template <class W, class = typename std::enable_if<!std::is_same<W, V>::value>::type>
+  Iterator_(const Iterator_<T, typename std::remove_const<Tree>::type, W>& it)
+      : tree_(it.tree_), idx_(it.idx_) {}
+
+  reference operator*() const { return tree_->nodes_[idx_].value(); }
+  pointer operator->() const { return &tree_->nodes_[idx_].value(); }
+  Self_& operator++() { idx_ = tree_->Next_(idx_); return *this; }
+  Self_& operator--() { idx_ = tree_->Prev_(idx_); return *this; }
+  Self_ operator++(int) { Self_ tmp = *this; ++*this; return tmp; }
+  Self_ operator--(int) { Self_ tmp = *this; --*this; return tmp; }
+  Self_& operator+=(difference_type x) {
+    idx_ = tree_->Select_(tree_->Order_(idx_) + x);
+    return *this;
+  }
+  Self_& operator-=(difference_type x) { return *this += -x; }
+  Self_ operator+(difference_type x) const { Self_ tmp = *this; return tmp += x; }
+  Self_ operator-(difference_type x) const { Self_ tmp = *this; return tmp += -x; }
+  difference_type operator-(const Self_& it) const {
+    return (difference_type)tree_->Order_(idx_) - (difference_type)tree_->Order_(it.idx_);
+  }
+  reference operator[](difference_type x) const { return *(*this + x); }
+  bool operator==(const Self_& it) const { return idx_ == it.idx_; }
+  bool operator!=(const Self_& it) const { return idx_ != it.idx_; }
+  bool operator<(const Self_& it) const { return *this - it < 0; }
+  bool operator<=(const Self_& it) const { return !(it < *this); }
+  bool operator>(const Self_& it) const { return it < *this; }
+  bool operator>=(const Self_& it) const { return !(*this < it); }
+
+  template <class, class, class> friend class Iterator_;
+  friend class CompactRBTree<T>;
+};
+
+} // namespace CompactRBTreeBase_
+
+template <class T> class CompactRBTree {
+  typedef CompactRBTreeBase_::Node_<T> Node_;
+  static const uint32_t kRed_ = 0x80000000u;
+  // the color lives in the top bit of parent, so indices stay below it
+  static const uint32_t kMaxCap_ = 0x7FFFFFFFu;
+
+  Node_* nodes_; // nodes_[0] is nil
+  uint32_t cap_, root_, free_;
+
+  uint32_t& L_(uint32_t x) { return nodes_[x].left; }
+  uint32_t& R_(uint32_t x) { return nodes_[x].right; }
+  uint32_t& S_(uint32_t x) { return nodes_[x].size; }
+  uint32_t P_(uint32_t x) const { return nodes_[x].parent & ~kRed_; }
+  bool IsRed_(uint32_t x) const { return nodes_[x].parent & kRed_; }
+  void SetParent_(uint32_t x, uint32_t p) {
+    nodes_[x].parent = (nodes_[x].parent & kRed_) | p;
+  }
+  void SetRed_(uint32_t x, bool red) {
+    nodes_[x].parent = (nodes_[x].parent & ~kRed_) | (red ? kRed_ : 0);
+  }
+
+  uint32_t First_(uint32_t x) const {
+    for (; nodes_[x].left; x = nodes_[x].left);
+    return x;
+  }
+  uint32_t Last_(uint32_t x) const {
+    for (; nodes_[x].right; x = nodes_[x].right);
+    return x;
+  }
+  uint32_t Next_(uint32_t x) const {
+    if (nodes_[x].right) return First_(nodes_[x].right);
+    uint32_t p = P_(x);
+    for (; p && nodes_[p].right == x; x = p, p = P_(p));
+    return p;
+  }
+  uint32_t Prev_(uint32_t x) const {
+    if (!x) return Last_(root_);
+    if (nodes_[x].left) return Last_(nodes_[x].left);
+    uint32_t p = P_(x);
+    for (; p && nodes_[p].left == x; x = p, p = P_(p));
+    return p;
+  }
+  size_t Order_(uint32_t x) const {
+    if (!x) return nodes_[root_].size;
+    size_t ans = nodes_[nodes_[x].left].size;
+    for (uint32_t p = P_(x); p; x = p, p = P_(p)) {
+      if (nodes_[p].right == x) ans += nodes_[nodes_[p].left].size + 1;
+    }
+    return ans;
+  }
+  uint32_t Select_(size_t k) const {
+    uint32_t x = root_;
+    if (k >= nodes_[x].size) return 0;
+    while (true) {
+      size_t ls = nodes_[nodes_[x].left].size;
+      if (k == ls) return x;
+      if (k < ls) {
+        x = nodes_[x].left;
+      } else {
+        k -= ls + 1;
+        x = nodes_[x].right;
+      }
+    }
+  }
+
+  void Grow_(uint32_t cap) {
+    Node_* nodes = (Node_*)malloc(sizeof(Node_) * cap);
+    if (std::is_trivially_copyable<T>::value) {
+      if (cap_) memcpy((void*)nodes, (void*)nodes_, sizeof(Node_) * cap_);
+    } else {
+      for (uint32_t i = 0; i < cap_; i++) {
+        static_cast<CompactRBTreeBase_::Link_&>(nodes[i]) = nodes_[i];
+        if (nodes_[i].size) {
+          new(&nodes[i].raw) T(std::move(nodes_[i].value()));
+          nodes_[i].value().~T();
+        }
+      }
+    }
+    uint32_t start = cap_ ? cap_ : 1;
+    for (uint32_t i = start; i < cap; i++) {
+      nodes[i].size = 0;
+      nodes[i].left = i + 1 < cap ? i + 1 : free_;
+    }
+    if (!cap_) {
+      nodes[0].left = nodes[0].right = nodes[0].parent = nodes[0].size = 0;
+    }
+    if (start < cap) free_ = start;
+    free(nodes_);
+    nodes_ = nodes;
+    cap_ = cap;
+  }
+  uint32_t AllocNode_() {
+    if (!free_) {
+      if (cap_ == kMaxCap_) throw std::length_error("CompactRBTree: pool is full");
+      Grow_(!cap_ ? 16 : cap_ > kMaxCap_ / 2 ? kMaxCap_ : cap_ * 2);
+    }
+    uint32_t x = free_;
+    free_ = nodes_[x].left;
+    nodes_[x].left = nodes_[x].right = 0;
+    nodes_[x].parent = kRed_;
+    nodes_[x].size = 1;
+    return x;
+  }
+  void FreeNode_(uint32_t x) {
+    nodes_[x].value().~T();
+    nodes_[x].size = 0;
+    nodes_[x].left = free_;
+    free_ = x;
+  }
+
+  void RotateLeft_(uint32_t x) {
+    uint32_t y = R_(x), p = P_(x);
+    R_(x) = L_(y);
+    if (L_(y)) SetParent_(L_(y), x);
+    SetParent_(y, p);
+    if (!p) {
+      root_ = y;
+    } else {
+      (L_(p) == x ? L_(p) : R_(p)) = y;
+    }
+    L_(y) = x;
+    SetParent_(x, y);
+    S_(y) = S_(x);
+    S_(x) = S_(L_(x)) + S_(R_(x)) + 1;
+  }
+  void RotateRight_(uint32_t x) {
+    uint32_t y = L_(x), p = P_(x);
+    L_(x) = R_(y);
+    if (R_(y)) SetParent_(R_(y), x);
+    SetParent_(y, p);
+    if (!p) {
+      root_ = y;
+    } else {
+      (L_(p) == x ? L_(p) : R_(p)) = y;
+    }
+    R_(y) = x;
+    SetParent_(x, y);
+    S_(y) = S_(x);
+    S_(x) = S_(L_(x)) + S_(R_(x)) + 1;
+  }
+
+  // link fresh node z before position pos (pos == 0 means append)
+  void InsertBefore_(uint32_t pos, uint32_t z) {
+    uint32_t p;
+    bool left;
+    if (!root_) {
+      root_ = z;
+      nodes_[z].parent = 0;
+      return;
+    }
+    if (!pos) {
+      p = Last_(root_); left = false;
+    } else if (!L_(pos)) {
+      p = pos; left = true;
+    } else {
+      p = Last_(L_(pos)); left = false;
+    }
+    (left ? L_(p) : R_(p)) = z;
+    SetParent_(z, p);
+    for (uint32_t x = p; x; x = P_(x)) S_(x)++;
+    InsertRepair_(z);
+  }
+  void InsertRepair_(uint32_t z) {
+    while (IsRed_(P_(z))) {
+      uint32_t p = P_(z), g = P_(p);
+      if (p == L_(g)) {
+        uint32_t u = R_(g);
+        if (IsRed_(u)) {
+          SetRed_(p, false); SetRed_(u, false); SetRed_(g, true);
+          z = g;
+          continue;
+        }
+        if (z == R_(p)) RotateLeft_(z = p), p = P_(z);
+        SetRed_(p, false); SetRed_(g, true);
+        RotateRight_(g);
+      } else {
+        uint32_t u = L_(g);
+        if (IsRed_(u)) {
+          SetRed_(p, false); SetRed_(u, false); SetRed_(g, true);
+          z = g;
+          continue;
+        }
+        if (z == L_(p)) RotateRight_(z = p), p = P_(z);
+        SetRed_(p, false); SetRed_(g, true);
+        RotateLeft_(g);
+      }
+    }
+    SetRed_(root_, false);
+  }
+
+  // replace subtree u by v in u's parent; v may be nil, whose parent is then
+  // set temporarily for RemoveRepair_
+  void Transplant_(uint32_t u, uint32_t v) {
+    uint32_t p = P_(u);
+    if (!p) {
+      root_ = v;
+    } else {
+      (L_(p) == u ? L_(p) : R_(p)) = v;
+    }
+    SetParent_(v, p);
+  }
+  void Remove_(uint32_t z) {
+    uint32_t y = L_(z) && R_(z) ? First_(R_(z)) : z, x;
+    for (uint32_t w = y; w; w = P_(w)) S_(w)--;
+    bool red = IsRed_(y);
+    if (!L_(z)) {
+      x = R_(z);
+      Transplant_(z, x);
+    } else if (!R_(z)) {
+      x = L_(z);
+      Transplant_(z, x);
+    } else {
+      x = R_(y);
+      if (P_(y) == z) {
+        SetParent_(x, y);
+      } else {
+        Transplant_(y, x);
+        R_(y) = R_(z);
+        SetParent_(R_(y), y);
+      }
+      Transplant_(z, y);
+      L_(y) = L_(z);
+      SetParent_(L_(y), y);
+      SetRed_(y, IsRed_(z));
+      S_(y) = S_(z);
+    }
+    if (!red) RemoveRepair_(x);
+    nodes_[0].parent = 0;
+  }
+  void RemoveRepair_(uint32_t x) {
+    while (x != root_ && !IsRed_(x)) {
+      uint32_t p = P_(x);
+      if (x == L_(p)) {
+        uint32_t w = R_(p);
+        if (IsRed_(w)) {
+          SetRed_(w, false); SetRed_(p, true);
+          RotateLeft_(p);
+          w = R_(p);
+        }
+        if (!IsRed_(L_(w)) && !IsRed_(R_(w))) {
+          SetRed_(w, true);
+          x = p;
+        } else {
+          if (!IsRed_(R_(w))) {
+            SetRed_(L_(w), false); SetRed_(w, true);
+            RotateRight_(w);
+            w = R_(p);
+          }
+          SetRed_(w, IsRed_(p)); SetRed_(p, false); SetRed_(R_(w), false);
+          RotateLeft_(p);
+          x = root_;
+        }
+      } else {
+        uint32_t w = L_(p);
+        if (IsRed_(w)) {
+          SetRed_(w, false); SetRed_(p, true);
+          RotateRight_(p);
+          w = L_(p);
+        }
+        if (!IsRed_(L_(w)) && !IsRed_(R_(w))) {
+          SetRed_(w, true);
+          x = p;
+        } else {
+          if (!IsRed_(L_(w))) {
+            SetRed_(R_(w), false); SetRed_(w, true);
+            RotateLeft_(w);
+            w = L_(p);
+          }
+          SetRed_(w, IsRed_(p)); SetRed_(p, false); SetRed_(L_(w), false);
+          RotateRight_(p);
+          x = root_;
+        }
+      }
+    }
+    SetRed_(x, false);
+  }
+
+  template <class... Args> uint32_t Emplace_(uint32_t pos, Args&&... args) {
+    uint32_t z;
+    if (free_) {
+      z = AllocNode_();
+      new(&nodes_[z].raw) T(std::forward<Args>(args)...);
+    } else {
+      // args may refer into the pool, which growing moves: build first
+      T val(std::forward<Args>(args)...);
+      z = AllocNode_();
+      new(&nodes_[z].raw) T(std::move(val));
+    }
+    InsertBefore_(pos, z);
+    return z;
+  }
+  void Clear_() {
+    for (uint32_t i = 1; i < cap_; i++) {
+      if (nodes_[i].size) nodes_[i].value().~T();
+    }
+    free(nodes_);
+    nodes_ = nullptr;
+    cap_ = root_ = free_ = 0;
+  }
+  void Init_() {
+    nodes_ = nullptr;
+    cap_ = root_ = free_ = 0;
+    Grow_(1);
+  }
+ public:
+  typedef T value_type;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef CompactRBTreeBase_::Iterator_<T, CompactRBTree, T> iterator;
+  typedef CompactRBTreeBase_::Iterator_<T, const CompactRBTree, const T> const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  CompactRBTree() { Init_(); }
+  CompactRBTree(const CompactRBTree& tree) {
+    Init_();
+    reserve(tree.size());
+    for (const T& x : tree) push_back(x);
+  }
+  CompactRBTree(CompactRBTree&& tree) {
+    Init_();
+    swap(tree);
+  }
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  CompactRBTree(Iter first, Iter last) {
+    Init_();
+    for (; first != last; ++first) push_back(*first);
+  }
+  ~CompactRBTree() { Clear_(); }
+
+  CompactRBTree& operator=(const CompactRBTree& tree) {
+    if (this != &tree) {
+      CompactRBTree tmp(tree);
+      swap(tmp);
+    }
+    return *this;
+  }
+  CompactRBTree& operator=(CompactRBTree&& tree) {
+    swap(tree);
+    return *this;
+  }
+
+  iterator begin() { return iterator(this, root_ ? First_(root_) : 0); }
+  const_iterator begin() const { return const_iterator(this, root_ ? First_(root_) : 0); }
+  const_iterator cbegin() const { return begin(); }
+  iterator end() { return iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, 0); }
+  const_iterator cend() const { return end(); }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+  bool empty() const { return !root_; }
+  size_type size() const { return nodes_[root_].size; }
+  // slots allocated in the pool, including free ones and nil
+  size_type capacity() const { return cap_; }
+  void reserve(size_type n) {
+    if (n >= kMaxCap_) throw std::length_error("CompactRBTree::reserve");
+    if (n + 1 > cap_) Grow_(n + 1);
+  }
+
+  reference operator[](size_type x) { return nodes_[Select_(x)].value(); }
+  const_reference operator[](size_type x) const { return nodes_[Select_(x)].value(); }
+  reference front() { return nodes_[First_(root_)].value(); }
+  const_reference front() const { return nodes_[First_(root_)].value(); }
+  reference back() { return nodes_[Last_(root_)].value(); }
+  const_reference back() const { return nodes_[Last_(root_)].value(); }
+
+  void push_back(const T& val) { Emplace_(0, val); }
+  void push_back(T&& val) { Emplace_(0, std::move(val)); }
+  void push_front(const T& val) { Emplace_(root_ ? First_(root_) : 0, val); }
+  void push_front(T&& val) { Emplace_(root_ ? First_(root_) : 0, std::move(val)); }
+  template <class... Args> void emplace_back(Args&&... args) {
+    Emplace_(0, std::forward<Args>(args)...);
+  }
+  template <class... Args> void emplace_front(Args&&... args) {
+    Emplace_(root_ ? First_(root_) : 0, std::forward<Args>(args)...);
+  }
+  iterator insert(const_iterator it, const T& val) {
+    return iterator(this, Emplace_(it.idx_, val));
+  }
+  iterator insert(const_iterator it, T&& val) {
+    return iterator(this, Emplace_(it.idx_, std::move(val)));
+  }
+  template <class... Args> iterator emplace(const_iterator it, Args&&... args) {
+    return iterator(this, Emplace_(it.idx_, std::forward<Args>(args)...));
+  }
+  void pop_back() { erase(iterator(this, Last_(root_))); }
+  void pop_front() { erase(iterator(this, First_(root_))); }
+  iterator erase(const_iterator it) {
+    uint32_t nxt = Next_(it.idx_);
+    Remove_(it.idx_);
+    FreeNode_(it.idx_);
+    return iterator(this, nxt);
+  }
+  void clear() {
+    Clear_();
+    Init_();
+  }
+  void swap(CompactRBTree& x) {
+    std::swap(nodes_, x.nodes_);
+    std::swap(cap_, x.cap_);
+    std::swap(root_, x.root_);
+    std::swap(free_, x.free_);
+  }
+
+  template <class, class, class> friend class CompactRBTreeBase_::Iterator_;
+};
+
+template <class T> void swap(CompactRBTree<T>& a, CompactRBTree<T>& b) {
+  a.swap(b);
+}
+
+#endif
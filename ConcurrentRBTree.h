@@ -0,0 +1,123 @@
+#ifndef CONCURRENT_RBTREE_H_
+#define CONCURRENT_RBTREE_H_
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "PersistentRBTree.h"
+
+// Single-writer, many-reader sequence built on PersistentRBTree.
+//
+// The writer edits a private working tree (path copying keeps every
+// published version intact) and calls publish() to make the current state
+// visible. Readers pin a published version with read(); pinning announces
+// the global epoch in a per-reader slot and never waits for the writer, and
+// reads touch no shared counters, so reader throughput scales with cores.
+// A replaced version is destroyed once every slot has moved past the epoch
+// it was retired in (epoch-based reclamation).
+//
+// At most kSlots readers may be pinned at the same time; further readers
+// spin until a slot frees up. Everything except read() must be called from
+// the writer thread.
+
+template <class T, class PullFunc = Nop, class PushFunc = Nop,
+          class Alloc = allocator<T>, size_t kSlots = 128>
+class ConcurrentRBTree {
+ public:
+  typedef PersistentRBTree<T, PullFunc, PushFunc, Alloc> version_type;
+ private:
+  struct alignas(64) Slot_ {
+    std::atomic<uint64_t> epoch; // 0: free, otherwise the pinned epoch
+  };
+
+  alignas(64) std::atomic<const version_type*> published_;
+  alignas(64) std::atomic<uint64_t> epoch_;
+  mutable Slot_ slots_[kSlots];
+  version_type work_;
+  std::vector<std::pair<uint64_t, const version_type*>> retired_;
+
+  size_t Pin_() const {
+    static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (size_t i = hint % kSlots, tries = 0;; i = (i + 1) % kSlots) {
+      uint64_t e = epoch_.load(), zero = 0;
+      if (slots_[i].epoch.compare_exchange_strong(zero, e)) {
+        return hint = i;
+      }
+      if (++tries % kSlots == 0) std::this_thread::yield();
+    }
+  }
+  uint64_t MinEpoch_() const {
+    uint64_t ret = UINT64_MAX;
+    for (size_t i = 0; i < kSlots; i++) {
+      uint64_t e = slots_[i].epoch.load();
+      if (e && e < ret) ret = e;
+    }
+    return ret;
+  }
+ public:
+  typedef T value_type;
+  typedef size_t size_type;
+
+  // pinned view of one published version; keep it short-lived, since an
+  // outstanding Reader holds back reclamation of every later version
+  class Reader {
+    const ConcurrentRBTree* tree_;
+    size_t slot_;
+    const version_type* ver_;
+    Reader(const ConcurrentRBTree* tree) : tree_(tree), slot_(tree->Pin_()),
+        ver_(tree->published_.load()) {}
+   public:
+    Reader(Reader&& x) : tree_(x.tree_), slot_(x.slot_), ver_(x.ver_) { x.tree_ = nullptr; }
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    ~Reader() {
+      if (tree_) tree_->slots_[slot_].epoch.store(0, std::memory_order_release);
+    }
+    const version_type& operator*() const { return *ver_; }
+    const version_type* operator->() const { return ver_; }
+
+    friend class ConcurrentRBTree;
+  };
+
+  ConcurrentRBTree() : published_(new version_type()), epoch_(1) {
+    for (size_t i = 0; i < kSlots; i++) slots_[i].epoch.store(0);
+  }
+  ConcurrentRBTree(const ConcurrentRBTree&) = delete;
+  ConcurrentRBTree& operator=(const ConcurrentRBTree&) = delete;
+  ~ConcurrentRBTree() {
+    for (auto& x : retired_) delete x.second;
+    delete published_.load();
+  }
+
+  // readers
+  Reader read() const { return Reader(this); }
+
+  // writer: the working tree; changes become visible on publish()
+  version_type& writable() { return work_; }
+  const version_type& writable() const { return work_; }
+  // O(1) snapshot of the working tree, then retire what it replaced
+  void publish() {
+    const version_type* old = published_.exchange(new version_type(work_));
+    retired_.emplace_back(epoch_.fetch_add(1), old);
+    reclaim();
+  }
+  // destroy retired versions no reader can still see; returns how many
+  // remain pending
+  size_t reclaim() {
+    uint64_t lim = MinEpoch_();
+    size_t j = 0;
+    for (auto& x : retired_) {
+      if (x.first < lim) {
+        delete x.second;
+      } else {
+        retired_[j++] = x;
+      }
+    }
+    retired_.resize(j);
+    return j;
+  }
+};
+
+#endif
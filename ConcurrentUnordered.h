@@ -0,0 +1,117 @@
+#ifndef CONCURRENT_UNORDERED_H_
+#define CONCURRENT_UNORDERED_H_
+
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <functional>
+#include "Unordered.h"
+
+// Hash map shared by many threads: keys are spread over kShards independent
+// UnorderedMaps by the high bits of the (remixed) hash, and every shard has
+// its own reader-writer lock, so operations on different shards never
+// contend and a shard grows without stopping the others.
+//
+// Nothing hands out references into the table: find copies the value out
+// and update runs a callback under the shard's exclusive lock.
+
+template <class Key, class T, class Hash = std::hash<Key>, class Pred = std::equal_to<Key>,
+          size_t kShards = 64>
+class ConcurrentUnorderedMap {
+  static_assert(kShards && !(kShards & (kShards - 1)), "kShards must be a power of two");
+ public:
+  typedef Key key_type;
+  typedef T mapped_type;
+  typedef size_t size_type;
+ private:
+  typedef UnorderedMap<Key, T, Hash, Pred> map_type;
+  struct alignas(64) Shard_ {
+    std::shared_mutex lock;
+    map_type map;
+  };
+
+  mutable Shard_ shards_[kShards];
+  Hash hasher_;
+
+  // std::hash of integers is the identity, so mix before taking high bits
+  Shard_& ShardOf_(const Key& key) const {
+    uint64_t h = (uint64_t)hasher_(key) * 0x9e3779b97f4a7c15ull;
+    return shards_[kShards == 1 ? 0 : h >> (64 - std::__lg(kShards))];
+  }
+ public:
+  // every shard hashes with a copy of hf, as does the shard selection
+  explicit ConcurrentUnorderedMap(const Hash& hf = Hash()) : hasher_(hf) {
+    for (Shard_& s : shards_) s.map = map_type(4, hf);
+  }
+  ConcurrentUnorderedMap(const ConcurrentUnorderedMap&) = delete;
+  ConcurrentUnorderedMap& operator=(const ConcurrentUnorderedMap&) = delete;
+
+  // copies the value into out if key is present
+  bool find(const Key& key, T& out) const {
+    Shard_& s = ShardOf_(key);
+    std::shared_lock<std::shared_mutex> guard(s.lock);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) return false;
+    out = it->second;
+    return true;
+  }
+  bool contains(const Key& key) const {
+    Shard_& s = ShardOf_(key);
+    std::shared_lock<std::shared_mutex> guard(s.lock);
+    return s.map.find(key) != s.map.end();
+  }
+  // true if inserted, false if key was already present (value untouched)
+  bool insert(const Key& key, const T& val) {
+    Shard_& s = ShardOf_(key);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    return s.map.try_emplace(key, val).second;
+  }
+  // true if inserted, false if an existing value was overwritten
+  bool insert_or_assign(const Key& key, const T& val) {
+    Shard_& s = ShardOf_(key);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    return s.map.insert_or_assign(key, val).second;
+  }
+  bool erase(const Key& key) {
+    Shard_& s = ShardOf_(key);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    return s.map.erase(key);
+  }
+  // runs fn(T&) on the value of key under the shard's exclusive lock;
+  // false if key is absent. fn must not call back into this map.
+  template <class F> bool update(const Key& key, F fn) {
+    Shard_& s = ShardOf_(key);
+    std::unique_lock<std::shared_mutex> guard(s.lock);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) return false;
+    fn(it->second);
+    return true;
+  }
+
+  // the shards are locked one at a time, so these are not atomic snapshots
+  size_type size() const {
+    size_type ret = 0;
+    for (Shard_& s : shards_) {
+      std::shared_lock<std::shared_mutex> guard(s.lock);
+      ret += s.map.size();
+    }
+    return ret;
+  }
+  bool empty() const { return size() == 0; }
+  void clear() {
+    for (Shard_& s : shards_) {
+      std::unique_lock<std::shared_mutex> guard(s.lock);
+      s.map.clear();
+    }
+  }
+  // calls fn(const Key&, const T&) for every element, one shard at a time
+  template <class F> void for_each(F fn) const {
+    for (Shard_& s : shards_) {
+      std::shared_lock<std::shared_mutex> guard(s.lock);
+      for (auto it = s.map.cbegin(); it != s.map.cend(); ++it) fn(it->first, it->second);
+    }
+  }
+};
+
+#endif
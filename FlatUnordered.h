@@ -0,0 +1,428 @@
+#ifndef FLAT_UNORDERED_H_
+#define FLAT_UNORDERED_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Open-addressing counterpart of UnorderedMap with the same interface.
+//
+// Elements live in groups of 15 slots, all groups in one allocation. Each
+// group starts with a 16-byte control word, directly followed by its slots:
+// one tag per slot (0: empty, otherwise 0x80 | 7 hash bits) and an overflow
+// counter, the number of keys that probed past this group because it was
+// full. A lookup matches all tags of
+// a group at once (SSE2 when available) and stops at the first group whose
+// counter is zero, so erase only clears the tag and decrements the counters
+// on the probe path; no tombstones are left behind. Counters saturate at
+// 255 and are reset by the next rehash.
+
+namespace FlatUnorderedBase_ {
+
+const size_t kGroup_ = 15;
+
+inline uint32_t Match_(const uint8_t* grp, uint8_t tag) {
+#ifdef __SSE2__
+  __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(grp));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(tag))) & 0x7fff;
+#else
+  uint32_t ret = 0;
+  for (size_t i = 0; i < kGroup_; i++) ret |= uint32_t(grp[i] == tag) << i;
+  return ret;
+#endif
+}
+inline uint32_t MatchFull_(const uint8_t* grp) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(grp))) & 0x7fff;
+#else
+  uint32_t ret = 0;
+  for (size_t i = 0; i < kGroup_; i++) ret |= uint32_t(grp[i] >> 7) << i;
+  return ret;
+#endif
+}
+
+// std::hash of integers is the identity; spread it over all 64 bits
+inline uint64_t Mix_(uint64_t h) {
+  unsigned __int128 p = (unsigned __int128)h * 0x9e3779b97f4a7c15ull;
+  return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+} // namespace FlatUnorderedBase_
+
+template <class Key, class T, class Hash = std::hash<Key>, class Pred = std::equal_to<Key>>
+class FlatUnorderedMap {
+public:
+  typedef std::pair<const Key, T> value_type;
+  typedef size_t size_type;
+
+private:
+  static const size_t kGroup_ = FlatUnorderedBase_::kGroup_;
+  static const size_t kAlign_ = alignof(value_type) > 16 ? alignof(value_type) : 16;
+  static const size_t kStride_ = (kAlign_ + kGroup_ * sizeof(value_type) + kAlign_ - 1) / kAlign_ * kAlign_;
+
+  template <bool kConst> class Iter_ {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<const Key, T> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename std::conditional<kConst, const value_type, value_type>::type V;
+    typedef V* pointer;
+    typedef V& reference;
+  private:
+    const uint8_t* ctrl_;
+    V* slot_;
+    Iter_(const uint8_t* c, V* s) : ctrl_(c), slot_(s) {}
+
+    void Step() {
+      if (((uintptr_t)ctrl_ & 15) == kGroup_ - 1) {
+        ctrl_ += kStride_ - (kGroup_ - 1);
+        slot_ = (V*)(ctrl_ + kAlign_);
+      } else {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+    void Skip() {
+      while (!*ctrl_) Step();
+    }
+    void Next() {
+      Step();
+      Skip();
+    }
+  public:
+    Iter_() : ctrl_(nullptr), slot_(nullptr) {}
+    template <bool k, class = typename std::enable_if<kConst && !k>::type>
+    Iter_(const Iter_<k>& a) : ctrl_(a.ctrl_), slot_(a.slot_) {}
+
+    const Iter_& operator++() { Next(); return *this; }
+    Iter_ operator++(int) { Iter_ prv(*this); Next(); return prv; }
+    bool operator==(const Iter_& a) const { return ctrl_ == a.ctrl_; }
+    bool operator!=(const Iter_& a) const { return ctrl_ != a.ctrl_; }
+    V& operator*() const { return *slot_; }
+    V* operator->() const { return slot_; }
+
+    template <bool> friend class Iter_;
+    friend class FlatUnorderedMap;
+  };
+
+public:
+  typedef Iter_<false> iterator;
+  typedef Iter_<true> const_iterator;
+
+private:
+  uint8_t* ctrl_; // groups, then the end marker
+  size_t mask_; // groups - 1
+  size_t size_;
+  size_t limit_; // grow before size_ would exceed this
+  Hash hasher_;
+  Pred pred_;
+  float alpha_;
+
+  static uint8_t Tag_(uint64_t h) { return uint8_t(h >> 57) | 0x80; }
+  template <class K> uint64_t Hash_(const K& key) const {
+    return FlatUnorderedBase_::Mix_(hasher_(key));
+  }
+  uint8_t* Group_(size_t g) const { return ctrl_ + g * kStride_; }
+  value_type* Slots_(uint8_t* grp) const { return (value_type*)(grp + kAlign_); }
+  value_type* Slot_(size_t i) const { return Slots_(Group_(i / kGroup_)) + i % kGroup_; }
+
+  // a table without storage: one empty group, then the end marker
+  static uint8_t* EmptyCtrl_() {
+    struct Empty {
+      alignas(kAlign_) uint8_t ctrl[kStride_ + 1];
+      Empty() : ctrl() { ctrl[kStride_] = 1; }
+    };
+    static Empty empty;
+    return empty.ctrl;
+  }
+  bool Owned_() const { return ctrl_ != EmptyCtrl_(); }
+
+  size_t Limit_(size_t groups) const {
+    size_t lim = groups * kGroup_ * alpha_;
+    return lim < groups * kGroup_ ? lim : groups * kGroup_ - 1;
+  }
+  size_t GroupsFor_(size_t n) const {
+    size_t g = 1;
+    while (Limit_(g) < n) g <<= 1;
+    return g;
+  }
+
+  void Allocate_(size_t groups) {
+    uint8_t* ctrl = (uint8_t*)aligned_alloc(kAlign_, groups * kStride_ + kAlign_);
+    if (!ctrl) throw std::bad_alloc();
+    ctrl_ = ctrl;
+    for (size_t g = 0; g < groups; g++) memset(Group_(g), 0, 16);
+    ctrl_[groups * kStride_] = 1;
+    mask_ = groups - 1;
+    limit_ = Limit_(groups);
+  }
+  void DestroyAll_() {
+    if (std::is_trivially_destructible<value_type>::value) return;
+    for (size_t g = 0; g <= mask_; g++) {
+      for (uint32_t m = FlatUnorderedBase_::MatchFull_(Group_(g)); m; m &= m - 1) {
+        Slots_(Group_(g))[__builtin_ctz(m)].~value_type();
+      }
+    }
+  }
+  void Destroy_() {
+    if (!Owned_()) return;
+    DestroyAll_();
+    free(ctrl_);
+  }
+  void Reset_() {
+    ctrl_ = EmptyCtrl_();
+    mask_ = size_ = limit_ = 0;
+  }
+
+  // slot holding key, or -1
+  template <class K> size_t Find_(const K& key, uint64_t h) const {
+    const uint8_t tag = Tag_(h);
+    for (size_t g = h & mask_, step = 0; step <= mask_; g = (g + ++step) & mask_) {
+      uint8_t* grp = Group_(g);
+      for (uint32_t m = FlatUnorderedBase_::Match_(grp, tag); m; m &= m - 1) {
+        if (pred_(Slots_(grp)[__builtin_ctz(m)].first, key)) return g * kGroup_ + __builtin_ctz(m);
+      }
+      if (!grp[kGroup_]) break;
+    }
+    return size_t(-1);
+  }
+  // first empty slot on the probe path of h; the caller constructs the
+  // element there and then publishes it, so a throwing constructor leaves
+  // the table untouched
+  size_t Claim_(uint64_t h) const {
+    for (size_t g = h & mask_, step = 0;; g = (g + ++step) & mask_) {
+      uint32_t m = FlatUnorderedBase_::Match_(Group_(g), 0);
+      if (m) return g * kGroup_ + __builtin_ctz(m);
+    }
+  }
+  // tags slot i, found by Claim_(h), as full and counts it in the overflow
+  // counters of the groups probed past
+  void Publish_(size_t i, uint64_t h) {
+    size_t home = i / kGroup_;
+    for (size_t g = h & mask_, step = 0; g != home; g = (g + ++step) & mask_) {
+      uint8_t& cnt = Group_(g)[kGroup_];
+      if (cnt != 255) cnt++;
+    }
+    Group_(home)[i % kGroup_] = Tag_(h);
+    size_++;
+  }
+  void EraseSlot_(size_t i) {
+    uint64_t h = Hash_(Slot_(i)->first);
+    size_t home = i / kGroup_;
+    for (size_t g = h & mask_, step = 0; g != home; g = (g + ++step) & mask_) {
+      uint8_t& cnt = Group_(g)[kGroup_];
+      if (cnt != 255) cnt--;
+    }
+    Group_(home)[i % kGroup_] = 0;
+    Slot_(i)->~value_type();
+    size_--;
+  }
+  void Resize_(size_t groups) {
+    uint8_t* octrl = ctrl_;
+    size_t ogroups = Owned_() ? mask_ + 1 : 0;
+    Allocate_(groups);
+    size_ = 0;
+    for (uint8_t* grp = octrl; grp != octrl + ogroups * kStride_; grp += kStride_) {
+      for (uint32_t m = FlatUnorderedBase_::MatchFull_(grp); m; m &= m - 1) {
+        value_type* src = Slots_(grp) + __builtin_ctz(m);
+        uint64_t h = Hash_(src->first);
+        size_t i = Claim_(h);
+        new (Slot_(i)) value_type(std::move(*src));
+        Publish_(i, h);
+        src->~value_type();
+      }
+    }
+    if (ogroups) free(octrl);
+  }
+
+  template <class K, class... Args>
+  std::pair<iterator, bool> Emplace_(const K& key, Args&&... args) {
+    uint64_t h = Hash_(key);
+    size_t i = Find_(key, h);
+    if (i != size_t(-1)) return {MakeIter_(i), false};
+    if (size_ >= limit_) {
+      // args may refer into the table, which Resize_ moves: build first
+      value_type val(std::forward<Args>(args)...);
+      Resize_(GroupsFor_(size_ + 1));
+      i = Claim_(h);
+      new (Slot_(i)) value_type(std::move(val));
+      Publish_(i, h);
+      return {MakeIter_(i), true};
+    }
+    i = Claim_(h);
+    new (Slot_(i)) value_type(std::forward<Args>(args)...);
+    Publish_(i, h);
+    return {MakeIter_(i), true};
+  }
+
+  iterator MakeIter_(size_t i) const {
+    return iterator(Group_(i / kGroup_) + i % kGroup_, Slot_(i));
+  }
+  iterator Begin_() const {
+    iterator it(ctrl_, Slots_(ctrl_));
+    it.Skip();
+    return it;
+  }
+  iterator End_() const {
+    return iterator(Group_(mask_ + 1), nullptr);
+  }
+public:
+  explicit FlatUnorderedMap(size_type bucket = 0, const Hash& hf = Hash(), const Pred& eq = Pred()) :
+      hasher_(hf), pred_(eq), alpha_(0.875) {
+    Reset_();
+    if (bucket) Resize_(GroupsFor_(bucket));
+  }
+  template <class It> FlatUnorderedMap(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred()) : hasher_(hf), pred_(eq), alpha_(0.875) {
+    Reset_();
+    size_t n = std::max<size_t>(bucket, std::distance(first, last));
+    if (n) Resize_(GroupsFor_(n));
+    for (; first != last; first++) insert(*first);
+  }
+  FlatUnorderedMap(const FlatUnorderedMap& mp) : hasher_(mp.hasher_), pred_(mp.pred_), alpha_(mp.alpha_) {
+    Reset_();
+    if (!mp.Owned_()) return;
+    Allocate_(mp.mask_ + 1);
+    for (size_t g = 0; g <= mask_; g++) {
+      memcpy(Group_(g), mp.Group_(g), 16);
+      for (uint32_t m = FlatUnorderedBase_::MatchFull_(Group_(g)); m; m &= m - 1) {
+        size_t j = __builtin_ctz(m);
+        new (Slots_(Group_(g)) + j) value_type(mp.Slots_(mp.Group_(g))[j]);
+      }
+    }
+    size_ = mp.size_;
+  }
+  FlatUnorderedMap(FlatUnorderedMap&& mp) : ctrl_(mp.ctrl_), mask_(mp.mask_),
+      size_(mp.size_), limit_(mp.limit_), hasher_(mp.hasher_), pred_(mp.pred_), alpha_(mp.alpha_) {
+    mp.Reset_();
+  }
+  ~FlatUnorderedMap() { Destroy_(); }
+
+  const FlatUnorderedMap& operator=(const FlatUnorderedMap& mp) {
+    if (this != &mp) {
+      FlatUnorderedMap tmp(mp);
+      swap(tmp);
+    }
+    return *this;
+  }
+  const FlatUnorderedMap& operator=(FlatUnorderedMap&& mp) {
+    if (this != &mp) {
+      Destroy_();
+      Reset_();
+      swap(mp);
+    }
+    return *this;
+  }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() {
+    if (!size_) return;
+    DestroyAll_();
+    for (size_t g = 0; g <= mask_; g++) memset(Group_(g), 0, 16);
+    size_ = 0;
+  }
+  void swap(FlatUnorderedMap& mp) {
+    std::swap(ctrl_, mp.ctrl_);
+    std::swap(mask_, mp.mask_);
+    std::swap(size_, mp.size_);
+    std::swap(limit_, mp.limit_);
+    std::swap(hasher_, mp.hasher_);
+    std::swap(pred_, mp.pred_);
+    std::swap(alpha_, mp.alpha_);
+  }
+
+  iterator begin() { return Begin_(); }
+  iterator end() { return End_(); }
+  const_iterator begin() const { return Begin_(); }
+  const_iterator end() const { return End_(); }
+  const_iterator cbegin() const { return Begin_(); }
+  const_iterator cend() const { return End_(); }
+
+  T& operator[](const Key& val) { return try_emplace(val).first->second; }
+  T& operator[](Key&& val) { return try_emplace(std::move(val)).first->second; }
+
+  const_iterator find(const Key& val) const {
+    size_t i = Find_(val, Hash_(val));
+    return i == size_t(-1) ? End_() : MakeIter_(i);
+  }
+  iterator find(const Key& val) {
+    size_t i = Find_(val, Hash_(val));
+    return i == size_t(-1) ? End_() : MakeIter_(i);
+  }
+
+  std::pair<iterator, bool> insert(const value_type& val) { return Emplace_(val.first, val); }
+  std::pair<iterator, bool> insert(value_type&& val) { return Emplace_(val.first, std::move(val)); }
+  template <class... Args> std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    return Emplace_(key, std::piecewise_construct, std::forward_as_tuple(key),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <class... Args> std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    return Emplace_(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args) {
+    value_type val(std::forward<Args>(args)...);
+    return Emplace_(val.first, std::move(val));
+  }
+  template <class M> std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    auto it = try_emplace(key, std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+  template <class M> std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+    auto it = try_emplace(std::move(key), std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+
+  void erase(const_iterator it) { 
+    size_t off = it.ctrl_ - ctrl_;
+    EraseSlot_(off / kStride_ * kGroup_ + off % kStride_);
+  }
+  size_type erase(const Key& val) {
+    size_t i = Find_(val, Hash_(val));
+    if (i == size_t(-1)) return 0;
+    EraseSlot_(i);
+    return 1;
+  }
+
+  // slots, not groups
+  size_type bucket_count() const { return Owned_() ? (mask_ + 1) * kGroup_ : 0; }
+  float load_factor() const { return bucket_count() ? (float)size_ / bucket_count() : 0; }
+  float max_load_factor() const { return alpha_; }
+  // open addressing needs free slots: clamped to [0.25, 0.95]
+  void max_load_factor(float na) {
+    alpha_ = std::min(std::max(na, 0.25f), 0.95f);
+    if (!Owned_()) return;
+    limit_ = Limit_(mask_ + 1);
+    if (size_ > limit_) Resize_(GroupsFor_(size_));
+  }
+  void rehash(size_type b) {
+    size_t g = GroupsFor_(size_);
+    while (g * kGroup_ < b) g <<= 1;
+    if (!Owned_() || g != mask_ + 1) Resize_(g);
+  }
+  void shrink_to_fit() {
+    if (!size_) {
+      Destroy_();
+      Reset_();
+    } else if (GroupsFor_(size_) != mask_ + 1) {
+      Resize_(GroupsFor_(size_));
+    }
+  }
+  void reserve(size_type n) {
+    if (n > limit_) Resize_(GroupsFor_(n));
+  }
+};
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef FROZEN_UNORDERED_H_
+#define FROZEN_UNORDERED_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Immutable hash map for tables that are built once and then only read,
+// e.g. FrozenUnorderedMap<K, V> f(mp.begin(), mp.end()) from an
+// UnorderedMap.
+//
+// The keys are placed with a minimal perfect hash (CHD: hash and displace).
+// Every key belongs to one of n / 4 buckets, and each bucket stores a
+// displacement d such that the keys of the bucket land on distinct free
+// slots under the slot hash for d. A lookup reads the displacement of its
+// bucket (4 bytes per 4 keys, usually cached), then exactly one slot, and
+// compares the key there. There are n slots for n keys and no empty ones.
+//
+// The whole table is one contiguous image: a 64-byte header, the
+// displacements, then the elements. save writes the image as is. load reads
+// it back, and map mmaps it read-only, so loading costs no parsing and
+// processes mapping the same file share its pages. Key and T must be
+// trivially copyable, and Hash must give the same values in the process
+// that reads the image as in the one that built it.
+
+namespace FrozenUnorderedBase_ {
+
+// murmur3 finalizer
+inline uint64_t Mix_(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+}
+// maps h onto [0, n)
+inline uint64_t Range_(uint64_t h, uint64_t n) {
+  return (unsigned __int128)h * n >> 64;
+}
+
+} // namespace FrozenUnorderedBase_
+
+template <class Key, class T, class Hash = std::hash<Key>, class Pred = std::equal_to<Key>>
+class FrozenUnorderedMap {
+  static_assert(std::is_trivially_copyable<Key>::value, "Key must be trivially copyable");
+  static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+public:
+  typedef std::pair<const Key, T> value_type;
+  typedef size_t size_type;
+  typedef const value_type* const_iterator;
+  typedef const_iterator iterator;
+
+private:
+  struct Header_ {
+    uint64_t magic; // kMagic_ << 32 | sizeof(value_type)
+    uint64_t key_size, mapped_size;
+    uint64_t size; // elements, equal to slots
+    uint64_t buckets;
+    uint64_t seed;
+    uint64_t slot_offset; // byte offset of the elements
+    uint64_t bytes; // whole image
+  };
+  static_assert(sizeof(Header_) == 64, "header must stay 64 bytes");
+  static const uint64_t kMagic_ = 0x315a5246; // "FRZ1"
+  static const size_t kAlign_ = 64;
+  static const size_t kBucketKeys_ = 4; // average keys per bucket
+  static const int kSeeds_ = 16; // seeds tried before build gives up
+
+  char* image_; // nullptr when empty
+  size_t bytes_;
+  bool mapped_; // image_ is an mmap, not malloc'd
+  const uint32_t* disp_;
+  const value_type* slots_;
+  uint64_t size_, buckets_, seed_;
+  Hash hasher_;
+  Pred pred_;
+
+  const Header_* Head_() const { return (const Header_*)image_; }
+  // one full mix per lookup: the bucket comes from its top bits, the slot
+  // from a multiply of the hash salted with the displacement
+  template <class K> uint64_t Hash_(const K& key) const {
+    return FrozenUnorderedBase_::Mix_(hasher_(key) ^ seed_);
+  }
+  uint64_t Bucket_(uint64_t h) const { return FrozenUnorderedBase_::Range_(h, buckets_); }
+  uint64_t Slot_(uint64_t h, uint32_t d) const {
+    uint64_t x = (h ^ (d + 1ull) * 0x9e3779b97f4a7c15ull) * 0xd6e8feb86659fd93ull;
+    return FrozenUnorderedBase_::Range_(x, size_);
+  }
+
+  void Release_() {
+    if (!image_) return;
+#ifdef __unix__
+    if (mapped_) munmap(image_, bytes_);
+    else free(image_);
+#else
+    free(image_);
+#endif
+  }
+  void Reset_() {
+    image_ = nullptr;
+    bytes_ = 0;
+    mapped_ = false;
+    disp_ = nullptr;
+    slots_ = nullptr;
+    size_ = buckets_ = seed_ = 0;
+  }
+  // checks an image of the given length and points the accessors into it;
+  // takes ownership either way
+  bool Attach_(char* image, size_t bytes, bool mapped) {
+    image_ = image;
+    bytes_ = bytes;
+    mapped_ = mapped;
+    const Header_* hd = Head_();
+    // every bound is checked by division, so crafted fields cannot wrap
+    if (bytes < sizeof(Header_) || hd->bytes != bytes ||
+        hd->magic != (kMagic_ << 32 | sizeof(value_type)) ||
+        hd->key_size != sizeof(Key) || hd->mapped_size != sizeof(T) ||
+        !hd->size || hd->buckets != hd->size / kBucketKeys_ + (hd->size % kBucketKeys_ != 0) ||
+        hd->buckets > (bytes - sizeof(Header_)) / sizeof(uint32_t) ||
+        hd->slot_offset < sizeof(Header_) + hd->buckets * sizeof(uint32_t) ||
+        hd->slot_offset > bytes || hd->slot_offset % alignof(value_type) ||
+        hd->size > (bytes - hd->slot_offset) / sizeof(value_type)) {
+      Release_();
+      Reset_();
+      return false;
+    }
+    size_ = hd->size;
+    buckets_ = hd->buckets;
+    seed_ = hd->seed;
+    disp_ = (const uint32_t*)(image_ + sizeof(Header_));
+    slots_ = (const value_type*)(image_ + hd->slot_offset);
+    return true;
+  }
+
+  // CHD placement of n hashes into n slots: buckets are handled from the
+  // largest down, each trying displacements until its keys hit free slots.
+  // False if two hashes are equal or no displacement fits.
+  bool Place_(const std::vector<uint64_t>& hs, std::vector<uint32_t>& disp) const {
+    size_t n = hs.size();
+    std::vector<uint32_t> start(buckets_ + 1), order(n), bucket_order(buckets_);
+    for (uint64_t h : hs) start[Bucket_(h) + 1]++;
+    for (size_t b = 0; b < buckets_; b++) start[b + 1] += start[b];
+    std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; i++) order[fill[Bucket_(hs[i])]++] = i;
+    for (size_t b = 0; b < buckets_; b++) bucket_order[b] = b;
+    std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](uint32_t a, uint32_t b) {
+      return start[a + 1] - start[a] > start[b + 1] - start[b];
+    });
+
+    std::vector<bool> taken(n);
+    std::vector<uint64_t> pos;
+    disp.assign(buckets_, 0);
+    for (uint32_t b : bucket_order) {
+      const uint32_t *first = order.data() + start[b], *last = order.data() + start[b + 1];
+      if (first == last) break;
+      for (const uint32_t* i = first; i != last; ++i) {
+        for (const uint32_t* j = first; j != i; ++j) {
+          if (hs[*i] == hs[*j]) return false;
+        }
+      }
+      for (uint32_t d = 0;; d++) {
+        if (d == UINT32_MAX) return false;
+        pos.clear();
+        bool ok = true;
+        for (const uint32_t* i = first; i != last && ok; ++i) {
+          uint64_t p = Slot_(hs[*i], d);
+          ok = !taken[p] && std::find(pos.begin(), pos.end(), p) == pos.end();
+          pos.push_back(p);
+        }
+        if (!ok) continue;
+        for (uint64_t p : pos) taken[p] = true;
+        disp[b] = d;
+        break;
+      }
+    }
+    return true;
+  }
+
+public:
+  explicit FrozenUnorderedMap(const Hash& hf = Hash(), const Pred& eq = Pred()) :
+      hasher_(hf), pred_(eq) {
+    Reset_();
+  }
+  // builds from distinct keys; the map stays empty if build fails
+  template <class It> FrozenUnorderedMap(It first, It last, const Hash& hf = Hash(),
+      const Pred& eq = Pred()) : hasher_(hf), pred_(eq) {
+    Reset_();
+    build(first, last);
+  }
+  FrozenUnorderedMap(const FrozenUnorderedMap& mp) : hasher_(mp.hasher_), pred_(mp.pred_) {
+    Reset_();
+    if (!mp.image_) return;
+    char* image = (char*)aligned_alloc(kAlign_, (mp.bytes_ + kAlign_ - 1) / kAlign_ * kAlign_);
+    if (!image) throw std::bad_alloc();
+    memcpy(image, mp.image_, mp.bytes_);
+    Attach_(image, mp.bytes_, false);
+  }
+  FrozenUnorderedMap(FrozenUnorderedMap&& mp) : image_(mp.image_), bytes_(mp.bytes_), mapped_(mp.mapped_),
+      disp_(mp.disp_), slots_(mp.slots_), size_(mp.size_), buckets_(mp.buckets_),
+      seed_(mp.seed_), hasher_(mp.hasher_), pred_(mp.pred_) {
+    mp.Reset_();
+  }
+  ~FrozenUnorderedMap() { Release_(); }
+
+  const FrozenUnorderedMap& operator=(const FrozenUnorderedMap& mp) {
+    if (this != &mp) {
+      FrozenUnorderedMap tmp(mp);
+      swap(tmp);
+    }
+    return *this;
+  }
+  const FrozenUnorderedMap& operator=(FrozenUnorderedMap&& mp) {
+    if (this != &mp) {
+      Release_();
+      Reset_();
+      swap(mp);
+    }
+    return *this;
+  }
+  void swap(FrozenUnorderedMap& mp) {
+    std::swap(image_, mp.image_);
+    std::swap(bytes_, mp.bytes_);
+    std::swap(mapped_, mp.mapped_);
+    std::swap(disp_, mp.disp_);
+    std::swap(slots_, mp.slots_);
+    std::swap(size_, mp.size_);
+    std::swap(buckets_, mp.buckets_);
+    std::swap(seed_, mp.seed_);
+    std::swap(hasher_, mp.hasher_);
+    std::swap(pred_, mp.pred_);
+  }
+
+  // Replaces the contents with [first, last), whose keys must be distinct.
+  // False (and an empty map) on duplicate keys or colliding hashes.
+  template <class It> bool build(It first, It last) {
+    std::vector<value_type> vals;
+    for (; first != last; ++first) vals.emplace_back(*first);
+    std::vector<uint64_t> hs(vals.size());
+    Release_();
+    Reset_();
+    if (vals.empty()) return true;
+
+    std::vector<uint32_t> disp;
+    size_ = vals.size();
+    buckets_ = (size_ + kBucketKeys_ - 1) / kBucketKeys_;
+    bool ok = false;
+    for (int s = 0; s < kSeeds_ && !ok; s++) {
+      seed_ = FrozenUnorderedBase_::Mix_(s + 1);
+      for (size_t i = 0; i < vals.size(); i++) hs[i] = Hash_(vals[i].first);
+      ok = Place_(hs, disp);
+    }
+    if (!ok) {
+      Reset_();
+      return false;
+    }
+
+    Header_ hd;
+    hd.magic = kMagic_ << 32 | sizeof(value_type);
+    hd.key_size = sizeof(Key);
+    hd.mapped_size = sizeof(T);
+    hd.size = size_;
+    hd.buckets = buckets_;
+    hd.seed = seed_;
+    hd.slot_offset = (sizeof(Header_) + buckets_ * sizeof(uint32_t) + kAlign_ - 1) / kAlign_ * kAlign_;
+    hd.bytes = (hd.slot_offset + size_ * sizeof(value_type) + kAlign_ - 1) / kAlign_ * kAlign_;
+    char* image = (char*)aligned_alloc(kAlign_, hd.bytes);
+    if (!image) {
+      Reset_();
+      return false;
+    }
+    memset(image, 0, hd.bytes);
+    memcpy(image, &hd, sizeof(hd));
+    memcpy(image + sizeof(Header_), disp.data(), buckets_ * sizeof(uint32_t));
+    value_type* slots = (value_type*)(image + hd.slot_offset);
+    for (size_t i = 0; i < size_; i++) {
+      new (slots + Slot_(hs[i], disp[Bucket_(hs[i])])) value_type(vals[i]);
+    }
+    return Attach_(image, hd.bytes, false);
+  }
+
+  // the image written by save, for callers doing their own I/O
+  const void* data() const { return image_; }
+  size_t bytes() const { return bytes_; }
+
+  bool save(const char* path) const {
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = !image_ || fwrite(image_, 1, bytes(), f) == bytes();
+    return fclose(f) == 0 && ok;
+  }
+  // reads an image into memory owned by the map; on failure the map is
+  // left empty (an empty file is an empty map)
+  bool load(const char* path) {
+    Release_();
+    Reset_();
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    bool ok = fseek(f, 0, SEEK_END) == 0;
+    long bytes = ok ? ftell(f) : -1;
+    ok = bytes >= 0 && fseek(f, 0, SEEK_SET) == 0;
+    if (ok && bytes) {
+      char* image = (char*)aligned_alloc(kAlign_, (bytes + kAlign_ - 1) / kAlign_ * kAlign_);
+      ok = image && fread(image, 1, bytes, f) == (size_t)bytes;
+      if (ok) ok = Attach_(image, bytes, false);
+      else free(image);
+    }
+    fclose(f);
+    return ok;
+  }
+#ifdef __unix__
+  // maps an image read-only; lookups fault its pages in on demand and
+  // every process mapping the file shares them. The file must not change
+  // while mapped.
+  bool map(const char* path) {
+    Release_();
+    Reset_();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size) {
+      void* image = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      ok = image != MAP_FAILED && Attach_((char*)image, st.st_size, true);
+    }
+    close(fd);
+    return ok;
+  }
+#endif
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_type bucket_count() const { return size_; }
+
+  const_iterator begin() const { return slots_; }
+  const_iterator end() const { return slots_ + size_; }
+  const_iterator cbegin() const { return slots_; }
+  const_iterator cend() const { return slots_ + size_; }
+
+  const_iterator find(const Key& key) const {
+    if (!size_) return end();
+    uint64_t h = Hash_(key);
+    const value_type* p = slots_ + Slot_(h, disp_[Bucket_(h)]);
+    return pred_(p->first, key) ? p : end();
+  }
+  size_type count(const Key& key) const { return find(key) != end(); }
+};
+
+#endif
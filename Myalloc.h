@@ -1,7 +1,11 @@
 #ifndef MYALLOC_H_
 #define MYALLOC_H_
 
+#include <cstddef>
 #include <cstdlib>
+#include <mutex>
+#include <utility>
+#include <type_traits>
 
 template <class T> struct allocator {
   typedef T value_type;
@@ -27,4 +31,212 @@ template <class T> struct allocator {
   template <class U> bool operator!=(const allocator<U>&) const { return false; }
 };
 
+namespace MyallocBase_ {
+
+// Free-list pool of fixed-size blocks. Blocks are carved sequentially out of
+// slabs of kChunk blocks, so nodes allocated together stay close in memory.
+// Every thread owns its own pool; a block may be returned on any thread and is
+// then recycled by that thread. When a thread exits, its free blocks and the
+// uncarved rest of its slab go to a shared list that other pools drain before
+// allocating a new slab. Slabs are never given back to the system.
+template <size_t kSize, size_t kAlign, size_t kChunk> class FixedPool_ {
+  struct Free_ { Free_* nxt; };
+  static constexpr size_t kRaw_ = kSize < sizeof(Free_) ? sizeof(Free_) : kSize;
+  static constexpr size_t kBlock_ = (kRaw_ + kAlign - 1) / kAlign * kAlign;
+
+  struct Orphans_ {
+    std::mutex lock;
+    Free_* free = nullptr;
+  };
+  static Orphans_& Orphans() {
+    static Orphans_ orphans;
+    return orphans;
+  }
+
+  Free_* free_;
+  char *now_, *end_;
+
+  // touching Orphans() here makes it outlive every pool
+  FixedPool_() : free_(nullptr), now_(nullptr), end_(nullptr) { Orphans(); }
+  ~FixedPool_() {
+    for (; now_ != end_; now_ += kBlock_) Put(now_);
+    if (!free_) return;
+    Free_* last = free_;
+    while (last->nxt) last = last->nxt;
+    Orphans_& o = Orphans();
+    std::lock_guard<std::mutex> guard(o.lock);
+    last->nxt = o.free;
+    o.free = free_;
+  }
+ public:
+  static FixedPool_& Instance() {
+    static thread_local FixedPool_ pool;
+    return pool;
+  }
+  void* Get() {
+    if (!free_ && now_ == end_) {
+      Orphans_& o = Orphans();
+      std::lock_guard<std::mutex> guard(o.lock);
+      free_ = o.free;
+      o.free = nullptr;
+    }
+    if (free_) {
+      void* ret = free_;
+      free_ = free_->nxt;
+      return ret;
+    }
+    if (now_ == end_) {
+      now_ = (char*)malloc(kBlock_ * kChunk);
+      end_ = now_ + kBlock_ * kChunk;
+    }
+    void* ret = now_;
+    now_ += kBlock_;
+    return ret;
+  }
+  void Put(void* a) {
+    Free_* nd = static_cast<Free_*>(a);
+    nd->nxt = free_;
+    free_ = nd;
+  }
+};
+
+} // namespace MyallocBase_
+
+// Stateless allocator for node-based containers: single-object requests are
+// served from a per-thread FixedPool_, anything larger falls back to malloc.
+// Since all instances share the pool, nodes may freely move between
+// containers (e.g. RBTree::split / RBTree::merge).
+template <class T, size_t kChunk = 1024> struct pool_allocator {
+  typedef T value_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  pool_allocator() = default;
+  template <class U> constexpr pool_allocator(const pool_allocator<U, kChunk>&) noexcept {}
+  template <class U> struct rebind { typedef pool_allocator<U, kChunk> other; };
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef void* void_pointer;
+  typedef const void* const_void_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+
+  T* allocate(size_t sz) const {
+    if (sz != 1) return (T*)malloc(sizeof(T) * sz);
+    return (T*)Pool_::Instance().Get();
+  }
+  void deallocate(T* a, size_t sz) const {
+    if (sz != 1) free(a);
+    else Pool_::Instance().Put(a);
+  }
+  template <class U, class... V> void construct(U* a, V... b) const { new(a) U(b...); }
+  template <class U> void destroy(U* a) const { a->~U(); }
+  size_t max_size() const { return -1; }
+
+  template <class U> bool operator==(const pool_allocator<U, kChunk>&) const { return true; }
+  template <class U> bool operator!=(const pool_allocator<U, kChunk>&) const { return false; }
+ private:
+  typedef MyallocBase_::FixedPool_<sizeof(T), alignof(T), kChunk> Pool_;
+};
+
+// Allocator with a private pool: single-object requests are carved out of
+// slabs and recycled through a free list, and release() drops every slab at
+// once (the caller must have destroyed the objects). The first slab holds 16
+// objects and each next one twice as many up to kChunk, so a small container
+// doesn't pay for a full slab.
+// A copy starts with an empty pool and never frees blocks of the original,
+// so memory has to go back to the instance it came from. Meant for one
+// container that owns all of its nodes, e.g. UnorderedMap.
+template <class T, size_t kChunk = 1024> class slab_allocator {
+  struct Free_ { Free_* nxt; };
+  struct Slab_ { Slab_* nxt; };
+  static constexpr size_t kRaw_ = sizeof(T) < sizeof(Free_) ? sizeof(Free_) : sizeof(T);
+  static constexpr size_t kAlign_ = alignof(T) < alignof(Free_) ? alignof(Free_) : alignof(T);
+  static constexpr size_t kBlock_ = (kRaw_ + kAlign_ - 1) / kAlign_ * kAlign_;
+  static constexpr size_t kHead_ = (sizeof(Slab_) + kAlign_ - 1) / kAlign_ * kAlign_;
+  static constexpr size_t kFirst_ = kChunk < 16 ? kChunk : 16;
+
+  Slab_* slabs_;
+  Free_* free_;
+  char *now_, *end_;
+  size_t grow_; // objects in the next slab
+ public:
+  typedef T value_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+  template <class U> struct rebind { typedef slab_allocator<U, kChunk> other; };
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef void* void_pointer;
+  typedef const void* const_void_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+
+  slab_allocator() : slabs_(nullptr), free_(nullptr), now_(nullptr), end_(nullptr), grow_(kFirst_) {}
+  slab_allocator(const slab_allocator&) : slab_allocator() {}
+  template <class U> slab_allocator(const slab_allocator<U, kChunk>&) : slab_allocator() {}
+  slab_allocator(slab_allocator&& a) :
+      slabs_(a.slabs_), free_(a.free_), now_(a.now_), end_(a.end_), grow_(a.grow_) {
+    a.slabs_ = nullptr; a.free_ = nullptr; a.now_ = a.end_ = nullptr; a.grow_ = kFirst_;
+  }
+  slab_allocator& operator=(const slab_allocator&) { return *this; }
+  slab_allocator& operator=(slab_allocator&& a) {
+    if (this != &a) {
+      release();
+      std::swap(slabs_, a.slabs_); std::swap(free_, a.free_);
+      std::swap(now_, a.now_); std::swap(end_, a.end_);
+      std::swap(grow_, a.grow_);
+    }
+    return *this;
+  }
+  ~slab_allocator() { release(); }
+
+  T* allocate(size_t sz) {
+    if (sz != 1) return (T*)malloc(sizeof(T) * sz);
+    if (free_) {
+      void* ret = free_;
+      free_ = free_->nxt;
+      return (T*)ret;
+    }
+    if (now_ == end_) {
+      Slab_* slab = (Slab_*)malloc(kHead_ + kBlock_ * grow_);
+      slab->nxt = slabs_;
+      slabs_ = slab;
+      now_ = (char*)slab + kHead_;
+      end_ = now_ + kBlock_ * grow_;
+      grow_ = grow_ < kChunk / 2 ? grow_ * 2 : kChunk;
+    }
+    void* ret = now_;
+    now_ += kBlock_;
+    return (T*)ret;
+  }
+  void deallocate(T* a, size_t sz) {
+    if (sz != 1) {
+      free(a);
+      return;
+    }
+    Free_* nd = reinterpret_cast<Free_*>(a);
+    nd->nxt = free_;
+    free_ = nd;
+  }
+  // returns every slab to the system; outstanding single-object blocks die
+  void release() {
+    for (Slab_* nxt; slabs_; slabs_ = nxt) {
+      nxt = slabs_->nxt;
+      free(slabs_);
+    }
+    free_ = nullptr;
+    now_ = end_ = nullptr;
+    grow_ = kFirst_;
+  }
+  template <class U, class... V> void construct(U* a, V... b) const { new(a) U(b...); }
+  template <class U> void destroy(U* a) const { a->~U(); }
+  size_t max_size() const { return -1; }
+
+  bool operator==(const slab_allocator& a) const { return this == &a; }
+  bool operator!=(const slab_allocator& a) const { return this != &a; }
+};
+
 #endif // MATRIX_H_INCLUDED
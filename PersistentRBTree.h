@@ -0,0 +1,480 @@
+#ifndef PERSISTENT_RBTREE_H_
+#define PERSISTENT_RBTREE_H_
+
+#include <cstdint>
+#include <atomic>
+#include <iterator>
+#include <algorithm>
+#include <memory>
+#include "Myalloc.h"
+#include "RBTree.h"
+
+// Sequence container with the positional interface of RBTree, in which
+// copies share structure. Nodes are reference counted and only written in
+// place while uniquely owned; every other write copies the node first, so
+// insert / erase / split / merge copy O(log n) nodes and copying a whole
+// tree (taking a snapshot) is O(1). There are no parent pointers: all
+// restructuring is done top-down with join-based split and merge.
+
+template <class T, class PullFunc, class PushFunc, class Alloc> class PersistentRBTree;
+
+namespace PersistentRBTreeBase_ {
+
+struct Node_ {
+  Node_ *left, *right;
+  size_t size;
+  std::atomic<uint32_t> ref;
+  uint8_t black_height; // starts from 1
+  bool black;
+  Node_() : left(nullptr), right(nullptr), size(1), ref(1),
+    black_height(1), black(false) {}
+  Node_(const Node_& x) : left(x.left), right(x.right), size(x.size), ref(1),
+    black_height(x.black_height), black(x.black) {}
+};
+
+template <class T> struct NodeVal_ : Node_ {
+  T value;
+  NodeVal_(const T& val) : Node_(), value(val) {}
+  NodeVal_(T&& val) : Node_(), value(std::move(val)) {}
+  NodeVal_(const NodeVal_& x) : Node_(x), value(x.value) {}
+  template <class... Args> NodeVal_(Args&&... args) : Node_(), value(args...) {}
+};
+
+inline size_t Size_(const Node_* nd) {
+  return nd ? nd->size : 0;
+}
+
+// Handle passed to PullFunc / PushFunc; mirrors the part of RBTreeIterator
+// used by them, so one functor can serve both trees.
+template <class T, class V> class NodeRef_ {
+  Node_* ptr_;
+  typedef NodeRef_ Self_;
+  NodeRef_(Node_* ptr) : ptr_(ptr) {}
+ public:
+  NodeRef_() : ptr_(nullptr) {}
+  template <class U> NodeRef_(const NodeRef_<T, U>& x) : ptr_(x.ptr_) {}
+
+  V& operator*() const { return static_cast<NodeVal_<T>*>(ptr_)->value; }
+  V* operator->() const { return &static_cast<NodeVal_<T>*>(ptr_)->value; }
+  bool is_null() const { return !ptr_; }
+  size_t tree_size() const { return Size_(ptr_); }
+  Self_ left_child() const { return ptr_->left; }
+  Self_ right_child() const { return ptr_->right; }
+  bool is_black() const { return ptr_->black; }
+  int black_height() const { return ptr_->black_height; }
+
+  template <class, class> friend class NodeRef_;
+  template <class, class, class, class> friend class ::PersistentRBTree;
+};
+
+template <class T> class ConstIterator_ {
+  static const int kMaxDepth_ = 128;
+  const Node_* stack_[kMaxDepth_];
+  int top_;
+  typedef ConstIterator_ Self_;
+
+  void PushLeft_(const Node_* nd) {
+    for (; nd; nd = nd->left) stack_[top_++] = nd;
+  }
+ public:
+  // iterator tags
+  typedef T value_type;
+  typedef const T& reference;
+  typedef const T* pointer;
+  typedef std::forward_iterator_tag iterator_category;
+  typedef ptrdiff_t difference_type;
+
+  ConstIterator_() : top_(0) {}
+  ConstIterator_(const Self_& it) : top_(it.top_) {
+    std::copy(it.stack_, it.stack_ + top_, stack_);
+  }
+  Self_& operator=(const Self_& it) {
+    top_ = it.top_;
+    std::copy(it.stack_, it.stack_ + top_, stack_);
+    return *this;
+  }
+
+  reference operator*() const {
+    return static_cast<const NodeVal_<T>*>(stack_[top_ - 1])->value;
+  }
+  pointer operator->() const {
+    return &static_cast<const NodeVal_<T>*>(stack_[top_ - 1])->value;
+  }
+  Self_& operator++() {
+    const Node_* nd = stack_[--top_];
+    PushLeft_(nd->right);
+    return *this;
+  }
+  Self_ operator++(int) {
+    Self_ tmp = *this;
+    ++*this;
+    return tmp;
+  }
+  bool operator==(const Self_& it) const {
+    return top_ == it.top_ && (!top_ || stack_[top_ - 1] == it.stack_[top_ - 1]);
+  }
+  bool operator!=(const Self_& it) const { return !(*this == it); }
+
+  template <class, class, class, class> friend class ::PersistentRBTree;
+};
+
+} // namespace PersistentRBTreeBase_
+
+template <class T> using PersistentRBTreeConstIterator = PersistentRBTreeBase_::ConstIterator_<T>;
+
+template <class T, class PullFunc = Nop, class PushFunc = Nop,
+          class Alloc = allocator<T>> class PersistentRBTree {
+ protected:
+  typedef PersistentRBTreeBase_::Node_ NodeBase_;
+  typedef PersistentRBTreeBase_::NodeVal_<T> NodeType_;
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<NodeType_> NodeAlloc_;
+  typedef std::allocator_traits<NodeAlloc_> NodeAllocTraits_;
+  typedef PersistentRBTreeBase_::NodeRef_<T, T> NodeRef_;
+
+  static size_t Size_(const NodeBase_* nd) { return PersistentRBTreeBase_::Size_(nd); }
+  static int BlackHeight_(const NodeBase_* nd) { return nd ? nd->black_height : 1; }
+  static bool IsRed_(const NodeBase_* nd) { return nd && !nd->black; }
+
+  NodeType_* Sup_(NodeBase_* nd) const {
+    return static_cast<NodeType_*>(nd);
+  }
+
+  template <class... Args> NodeType_* GenNode_(Args&&... args) {
+    NodeType_* ptr = NodeAllocTraits_::allocate(alloc_, 1);
+    new(ptr) NodeType_(std::forward<Args>(args)...);
+    return ptr;
+  }
+  void FreeNode_(NodeBase_* nd) {
+    Sup_(nd)->~NodeType_();
+    NodeAllocTraits_::deallocate(alloc_, Sup_(nd), 1);
+  }
+
+  static NodeBase_* Ref_(NodeBase_* nd) {
+    if (nd) nd->ref.fetch_add(1, std::memory_order_relaxed);
+    return nd;
+  }
+  void Unref_(NodeBase_* nd) {
+    while (nd && nd->ref.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      NodeBase_* r = nd->right;
+      Unref_(nd->left);
+      FreeNode_(nd);
+      nd = r;
+    }
+  }
+  // make an owned reference writable, copying the node if it is shared
+  NodeBase_* Mut_(NodeBase_* nd) {
+    if (nd->ref.load(std::memory_order_acquire) == 1) return nd;
+    NodeType_* ptr = GenNode_(static_cast<const NodeType_&>(*Sup_(nd)));
+    Ref_(ptr->left); Ref_(ptr->right);
+    Unref_(nd);
+    return ptr;
+  }
+
+  void Pull_(NodeBase_* nd) {
+    nd->size = Size_(nd->left) + Size_(nd->right) + 1;
+    if (!std::is_same<PullFunc, Nop>::value) {
+      pull_func_(NodeRef_(nd));
+    }
+  }
+  void Push_(NodeBase_* nd) {
+    if (!std::is_same<PushFunc, Nop>::value) {
+      if (nd->left) nd->left = Mut_(nd->left);
+      if (nd->right) nd->right = Mut_(nd->right);
+      push_func_(NodeRef_(nd));
+    }
+  }
+  NodeBase_* PaintBlack_(NodeBase_* nd) {
+    if (!nd || nd->black) return nd;
+    nd = Mut_(nd);
+    nd->black = true; nd->black_height++;
+    return nd;
+  }
+  NodeBase_* MakeNode_(NodeBase_* l, NodeBase_* m, NodeBase_* r, bool black) {
+    m->left = l; m->right = r;
+    m->black = black; m->black_height = BlackHeight_(l) + black;
+    Pull_(m);
+    return m;
+  }
+
+  // Top-down join. l and r are owned references with black roots (or null),
+  // m is a writable node with no pending tag.
+  NodeBase_* JoinRight_(NodeBase_* l, NodeBase_* m, NodeBase_* r) {
+    if (!IsRed_(l) && BlackHeight_(l) == BlackHeight_(r)) return MakeNode_(l, m, r, false);
+    l = Mut_(l); Push_(l);
+    l->right = JoinRight_(l->right, m, r);
+    if (l->black && IsRed_(l->right) && IsRed_(l->right->right)) {
+      NodeBase_* c = l->right;
+      NodeBase_* rr = c->right = Mut_(c->right);
+      rr->black = true; rr->black_height++;
+      l->right = c->left; c->left = l;
+      c->black_height = l->black_height;
+      Pull_(l); Pull_(c);
+      return c;
+    }
+    Pull_(l);
+    return l;
+  }
+  NodeBase_* JoinLeft_(NodeBase_* l, NodeBase_* m, NodeBase_* r) {
+    if (!IsRed_(r) && BlackHeight_(r) == BlackHeight_(l)) return MakeNode_(l, m, r, false);
+    r = Mut_(r); Push_(r);
+    r->left = JoinLeft_(l, m, r->left);
+    if (r->black && IsRed_(r->left) && IsRed_(r->left->left)) {
+      NodeBase_* c = r->left;
+      NodeBase_* ll = c->left = Mut_(c->left);
+      ll->black = true; ll->black_height++;
+      r->left = c->right; c->right = r;
+      c->black_height = r->black_height;
+      Pull_(r); Pull_(c);
+      return c;
+    }
+    Pull_(r);
+    return r;
+  }
+  NodeBase_* Join_(NodeBase_* l, NodeBase_* m, NodeBase_* r) {
+    if (BlackHeight_(l) > BlackHeight_(r)) return PaintBlack_(JoinRight_(l, m, r));
+    if (BlackHeight_(l) < BlackHeight_(r)) return PaintBlack_(JoinLeft_(l, m, r));
+    return MakeNode_(l, m, r, true);
+  }
+  // take a node apart: returns the writable node, its children as black roots
+  NodeBase_* Expose_(NodeBase_* nd, NodeBase_*& l, NodeBase_*& r) {
+    nd = Mut_(nd); Push_(nd);
+    l = PaintBlack_(nd->left); r = PaintBlack_(nd->right);
+    nd->left = nd->right = nullptr;
+    return nd;
+  }
+  void Split_(NodeBase_* nd, size_t k, NodeBase_*& left, NodeBase_*& right) {
+    // the first k elements go to left
+    if (!nd) { left = right = nullptr; return; }
+    NodeBase_ *l, *r;
+    nd = Expose_(nd, l, r);
+    size_t sz = Size_(l);
+    if (k < sz) {
+      Split_(l, k, left, l);
+      right = Join_(l, nd, r);
+    } else if (k == sz) {
+      left = l;
+      right = Join_(nullptr, nd, r);
+    } else {
+      Split_(r, k - sz - 1, r, right);
+      left = Join_(l, nd, r);
+    }
+  }
+  NodeBase_* SplitLast_(NodeBase_* nd, NodeBase_*& last) {
+    NodeBase_ *l, *r;
+    nd = Expose_(nd, l, r);
+    if (!r) { last = nd; return l; }
+    r = SplitLast_(r, last);
+    return Join_(l, nd, r);
+  }
+  NodeBase_* Join2_(NodeBase_* l, NodeBase_* r) {
+    if (!l) return r;
+    if (!r) return l;
+    NodeBase_* m;
+    l = SplitLast_(l, m);
+    return Join_(l, m, r);
+  }
+  template <class Func> NodeBase_* Update_(NodeBase_* nd, size_t x, Func& func) {
+    nd = Mut_(nd); Push_(nd);
+    size_t sz = Size_(nd->left);
+    if (x < sz) nd->left = Update_(nd->left, x, func);
+    else if (x > sz) nd->right = Update_(nd->right, x - sz - 1, func);
+    else func(Sup_(nd)->value);
+    Pull_(nd);
+    return nd;
+  }
+
+  template <class Iter>
+  NodeBase_* BuildTree_(Iter& first, size_t n, int depth, int red_depth) {
+    if (!n) return nullptr;
+    NodeBase_* l = BuildTree_(first, (n - 1) / 2, depth + 1, red_depth);
+    NodeBase_* nd = GenNode_(*first);
+    ++first;
+    NodeBase_* r = BuildTree_(first, n - 1 - (n - 1) / 2, depth + 1, red_depth);
+    return MakeNode_(l, nd, r, !depth || depth < red_depth);
+  }
+
+  NodeBase_* root_;
+  PullFunc pull_func_;
+  PushFunc push_func_;
+  NodeAlloc_ alloc_;
+ public:
+  typedef T value_type;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef PersistentRBTreeConstIterator<T> const_iterator;
+  typedef PersistentRBTreeBase_::NodeRef_<T, T> node_ref;
+  typedef PersistentRBTreeBase_::NodeRef_<T, const T> const_node_ref;
+  typedef Alloc allocator_type;
+
+  PersistentRBTree() : root_(nullptr) {}
+  PersistentRBTree(const PersistentRBTree& tree) : root_(Ref_(tree.root_)),
+      pull_func_(tree.pull_func_), push_func_(tree.push_func_) {}
+  PersistentRBTree(PersistentRBTree&& tree) : root_(tree.root_),
+      pull_func_(tree.pull_func_), push_func_(tree.push_func_) {
+    tree.root_ = nullptr;
+  }
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  PersistentRBTree(Iter first, Iter last) : root_(nullptr) {
+    assign(first, last);
+  }
+  ~PersistentRBTree() { Unref_(root_); }
+
+  PersistentRBTree& operator=(const PersistentRBTree& tree) {
+    NodeBase_* old = root_;
+    root_ = Ref_(tree.root_);
+    Unref_(old);
+    return *this;
+  }
+  PersistentRBTree& operator=(PersistentRBTree&& tree) {
+    std::swap(root_, tree.root_);
+    return *this;
+  }
+
+  const_iterator begin() const {
+    const_iterator it;
+    it.PushLeft_(root_);
+    return it;
+  }
+  const_iterator end() const { return const_iterator(); }
+  // iterator to position x in O(log n); end() if x >= size()
+  const_iterator iterator_at(size_type x) const {
+    const_iterator it;
+    if (x >= size()) return it;
+    for (const NodeBase_* nd = root_; nd;) {
+      size_t sz = Size_(nd->left);
+      if (sz == x) {
+        it.stack_[it.top_++] = nd;
+        break;
+      }
+      if (sz > x) {
+        it.stack_[it.top_++] = nd;
+        nd = nd->left;
+      } else {
+        x -= sz + 1;
+        nd = nd->right;
+      }
+    }
+    return it;
+  }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  // the writable version copies the root first if it is shared
+  node_ref root() {
+    if (root_) root_ = Mut_(root_);
+    return root_;
+  }
+  const_node_ref root() const { return root_; }
+
+  bool empty() const { return !root_; }
+  size_type size() const { return Size_(root_); }
+  // true if both trees currently share the same root (e.g. an untouched snapshot)
+  bool same_version(const PersistentRBTree& tree) const { return root_ == tree.root_; }
+
+  // no tags are pushed here, as in RBTree::operator[]
+  const_reference operator[](size_type x) const {
+    const NodeBase_* nd = root_;
+    while (true) {
+      size_t sz = Size_(nd->left);
+      if (sz == x) break;
+      if (sz > x) {
+        nd = nd->left;
+      } else {
+        x -= sz + 1;
+        nd = nd->right;
+      }
+    }
+    return static_cast<const NodeType_*>(nd)->value;
+  }
+  // pushes pending tags along the path, copying shared nodes
+  const_reference at(size_type x) {
+    const T* ret = nullptr;
+    auto func = [&](T& val) { ret = &val; };
+    root_ = Update_(root_, x, func);
+    return *ret;
+  }
+  const_reference front() const { return (*this)[0]; }
+  const_reference back() const { return (*this)[size() - 1]; }
+  // number of leading elements satisfying func, assuming monotonicity;
+  // no tags are pushed
+  template <class Pred> size_type partition_point(Pred&& func) const {
+    size_t ret = 0;
+    for (const NodeBase_* nd = root_; nd;) {
+      if (func(static_cast<const NodeType_*>(nd)->value)) {
+        ret += Size_(nd->left) + 1;
+        nd = nd->right;
+      } else {
+        nd = nd->left;
+      }
+    }
+    return ret;
+  }
+
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  void assign(Iter first, Iter last) {
+    clear();
+    size_t n = std::distance(first, last);
+    if (n) root_ = BuildTree_(first, n, 0, std::__lg(n));
+  }
+  // apply func to the element at position x and re-pull the path
+  template <class Func> void update(size_type x, Func&& func) {
+    root_ = Update_(root_, x, func);
+  }
+  void insert(size_type x, const T& val) {
+    NodeBase_ *l, *r;
+    Split_(root_, x, l, r);
+    root_ = Join_(l, GenNode_(val), r);
+  }
+  void insert(size_type x, T&& val) {
+    NodeBase_ *l, *r;
+    Split_(root_, x, l, r);
+    root_ = Join_(l, GenNode_(std::move(val)), r);
+  }
+  template <class... Args> void emplace(size_type x, Args&&... args) {
+    NodeBase_ *l, *r;
+    Split_(root_, x, l, r);
+    root_ = Join_(l, GenNode_(std::forward<Args>(args)...), r);
+  }
+  void push_back(const T& val) { insert(size(), val); }
+  void push_back(T&& val) { insert(size(), std::move(val)); }
+  void push_front(const T& val) { insert(0, val); }
+  void push_front(T&& val) { insert(0, std::move(val)); }
+  void erase(size_type x) {
+    NodeBase_ *l, *m, *r;
+    Split_(root_, x, l, r);
+    Split_(r, 1, m, r);
+    Unref_(m);
+    root_ = Join2_(l, r);
+  }
+  void pop_back() { erase(size() - 1); }
+  void pop_front() { erase(0); }
+  void clear() {
+    Unref_(root_);
+    root_ = nullptr;
+  }
+
+  void swap(PersistentRBTree& x) { std::swap(root_, x.root_); }
+  // append tree; tree may share nodes with *this (e.g. be a snapshot of it)
+  void merge(PersistentRBTree& tree) {
+    root_ = Join2_(root_, tree.root_);
+    tree.root_ = nullptr;
+  }
+  // elements from position x on are moved to tree
+  void split(size_type x, PersistentRBTree& tree) {
+    tree.clear();
+    Split_(root_, x, root_, tree.root_);
+  }
+
+  PullFunc& get_pull_object() { return pull_func_; }
+  PushFunc& get_push_object() { return push_func_; }
+  const PullFunc& get_pull_object() const { return pull_func_; }
+  const PushFunc& get_push_object() const { return push_func_; }
+  allocator_type get_allocator() const { return allocator_type(alloc_); }
+};
+
+template <class T, class U, class V, class A>
+void swap(PersistentRBTree<T, U, V, A>& a, PersistentRBTree<T, U, V, A>& b) {
+  a.swap(b);
+}
+
+#endif
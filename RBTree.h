@@ -2,10 +2,21 @@
 #define RBTREE_H_
 
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iterator>
 #include <algorithm>
-
-template <class T, class PullFunc, class PushFunc> class RBTree;
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "Myalloc.h"
+
+template <class T, class PullFunc, class PushFunc, class Alloc, class Stats> class RBTree;
 
 namespace RBTreeBase_ {
 
@@ -227,7 +238,7 @@ template <class T> class Iterator_ {
   friend class ConstIterator_<T>;
   friend class PreorderIterator_<T>;
   friend class PostorderIterator_<T>;
-  template <class, class, class> friend class ::RBTree;
+  template <class, class, class, class, class> friend class ::RBTree;
 };
 
 template <class T>
@@ -302,7 +313,7 @@ template <class T> class ConstIterator_ {
   bool is_black() const { return ptr_->black; }
   int black_height() const { return ptr_->black_height; }
 
-  template <class, class, class> friend class ::RBTree;
+  template <class, class, class, class, class> friend class ::RBTree;
 };
 
 template <class T> class PreorderIterator_ {
@@ -342,7 +353,7 @@ template <class T> class PreorderIterator_ {
 
   friend class Iterator_<T>;
   friend class PostorderIterator_<T>;
-  template <class, class, class> friend class ::RBTree;
+  template <class, class, class, class, class> friend class ::RBTree;
 };
 
 template <class T> class PostorderIterator_ {
@@ -382,7 +393,7 @@ template <class T> class PostorderIterator_ {
 
   friend class Iterator_<T>;
   friend class PreorderIterator_<T>;
-  template <class, class, class> friend class ::RBTree;
+  template <class, class, class, class, class> friend class ::RBTree;
 };
 
 template <class T>
@@ -390,6 +401,49 @@ inline ConstIterator_<T> operator+(ptrdiff_t x, ConstIterator_<T> it) {
   return it + x;
 }
 
+// Parked threads that run the forked halves of the parallel set
+// operations. A task goes to an idle worker, or to a new one if all are
+// busy, so nested forks never wait on each other. Workers live until exit,
+// which saves a thread start per fork; the set operations leave freeing
+// nodes to the calling thread, so no blocks pile up in workers' pools.
+class Workers_ {
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::deque<std::packaged_task<void()>> tasks_;
+  size_t idle_ = 0;
+
+  void Loop_() {
+    std::unique_lock<std::mutex> guard(lock_);
+    while (true) {
+      idle_++;
+      wake_.wait(guard, [this] { return !tasks_.empty(); });
+      idle_--;
+      std::packaged_task<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      guard.unlock();
+      task();
+      guard.lock();
+    }
+  }
+ public:
+  // never destroyed: detached workers may still be parked at exit
+  static Workers_& Instance() {
+    static Workers_* workers = new Workers_;
+    return *workers;
+  }
+  std::future<void> Run(std::packaged_task<void()> task) {
+    std::future<void> ret = task.get_future();
+    std::lock_guard<std::mutex> guard(lock_);
+    tasks_.push_back(std::move(task));
+    if (idle_ >= tasks_.size()) {
+      wake_.notify_one();
+    } else {
+      std::thread(&Workers_::Loop_, this).detach();
+    }
+    return ret;
+  }
+};
+
 } // namespace RBTreeBase_
 
 #ifdef DEBUG
@@ -402,15 +456,75 @@ struct Nop {
   template <class T> void operator()(T&& a) const {}
 };
 
+// Stats policies. RBTreeNoStats compiles every hook away; RBTreeStats counts
+// rebalancing work, functor calls, nodes walked (size updates, push paths,
+// descents) per operation and the depth of merge / split walks. Counters use
+// relaxed non-atomic increments, so counts from the threaded set operations
+// may be slightly low but never race.
+struct RBTreeNoStats {
+  struct snapshot_type {};
+  void rotate(int = 1) {}
+  void recolor(int = 1) {}
+  void pull() {}
+  void push() {}
+  void operation() {}
+  void visit(size_t = 1) {}
+  void merge(size_t) {}
+  void split(size_t) {}
+  snapshot_type snapshot() const { return snapshot_type(); }
+  void reset() {}
+};
+
+struct RBTreeStats {
+  struct snapshot_type {
+    uint64_t rotations, recolorings, pulls, pushes;
+    uint64_t operations, visited; // visited / operations: nodes per operation
+    uint64_t merges, merge_depth, splits, split_depth;
+  };
+ private:
+  struct Counter_ {
+    std::atomic<uint64_t> v;
+    Counter_() : v(0) {}
+    Counter_(const Counter_& x) : v(x.get()) {}
+    void add(uint64_t x) { v.store(v.load(std::memory_order_relaxed) + x, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+  };
+  Counter_ rotations_, recolorings_, pulls_, pushes_, operations_, visited_;
+  Counter_ merges_, merge_depth_, splits_, split_depth_;
+ public:
+  void rotate(int x = 1) { rotations_.add(x); }
+  void recolor(int x = 1) { recolorings_.add(x); }
+  void pull() { pulls_.add(1); }
+  void push() { pushes_.add(1); }
+  void operation() { operations_.add(1); }
+  void visit(size_t x = 1) { visited_.add(x); }
+  void merge(size_t depth) { merges_.add(1); merge_depth_.add(depth); }
+  void split(size_t depth) { splits_.add(1); split_depth_.add(depth); }
+  snapshot_type snapshot() const {
+    return {rotations_.get(), recolorings_.get(), pulls_.get(), pushes_.get(),
+            operations_.get(), visited_.get(),
+            merges_.get(), merge_depth_.get(), splits_.get(), split_depth_.get()};
+  }
+  void reset() {
+    for (Counter_* c : {&rotations_, &recolorings_, &pulls_, &pushes_, &operations_,
+                        &visited_, &merges_, &merge_depth_, &splits_, &split_depth_}) {
+      c->v.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
 template <class T> using RBTreeIterator = RBTreeBase_::Iterator_<T>;
 template <class T> using RBTreeConstIterator = RBTreeBase_::ConstIterator_<T>;
 template <class T> using RBTreePreorderIterator = RBTreeBase_::PreorderIterator_<T>;
 template <class T> using RBTreePostorderIterator = RBTreeBase_::PostorderIterator_<T>;
 
-template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
+template <class T, class PullFunc = Nop, class PushFunc = Nop,
+          class Alloc = allocator<T>, class Stats = RBTreeNoStats> class RBTree {
  protected:
   typedef RBTreeBase_::Node_ NodeBase_;
   typedef RBTreeBase_::NodeVal_<T> NodeType_;
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<NodeType_> NodeAlloc_;
+  typedef std::allocator_traits<NodeAlloc_> NodeAllocTraits_;
 
 #ifdef DEBUG
   void Print_(NodeType_* a) const {
@@ -451,11 +565,13 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
 
   void Pull_(NodeBase_* nd) {
     if (!std::is_same<PullFunc, Nop>::value) {
+      stats_.pull();
       pull_func_(iterator(nd));
     }
   }
   void Push_(NodeBase_* nd) {
     if (!std::is_same<PushFunc, Nop>::value) {
+      stats_.push();
       push_func_(iterator(nd));
     }
   }
@@ -463,6 +579,10 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   NodeType_* Sup_(NodeBase_* nd) const {
     return static_cast<NodeType_*>(nd);
   }
+  // iterator <-> node conversions for derived containers
+  static RBTreeIterator<T> Iter_(NodeBase_* nd) { return nd; }
+  static RBTreeConstIterator<T> ConstIter_(NodeBase_* nd) { return nd; }
+  static NodeBase_* Ptr_(RBTreeConstIterator<T> it) { return it.ptr_; }
 
   void PaintBlack_(NodeBase_* nd) const {
     if (nd) nd->black_height += !nd->black, nd->black = true;
@@ -477,13 +597,14 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   }
   NodeBase_* IncreaseSize_(NodeBase_* nd, NodeBase_* head, size_t sz = 1) {
     while (true) {
+      stats_.visit();
       nd->size += sz; Pull_(nd);
       if (nd->parent == head) return nd;
       nd = nd->parent;
     }
   }
   void DecreaseSize_(NodeBase_* nd) {
-    for (; nd != head_; nd = nd->parent) nd->size--, Pull_(nd);
+    for (; nd != head_; nd = nd->parent) stats_.visit(), nd->size--, Pull_(nd);
   }
   void PullFrom_(NodeBase_* nd) {
     if (!std::is_same<PullFunc, Nop>::value) {
@@ -497,6 +618,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       for (; nd->parent != head; nd = nd->parent, sz++) {
         dir = nd->parent->right == nd ? dir << 1 | 1 : dir << 1;
       }
+      stats_.visit(sz + 1);
       Push_(nd);
       while (sz--) {
         nd = dir & 1 ? nd->right : nd->left;
@@ -511,6 +633,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     while (true) {
       NodeBase_* p = nd->parent;
       if (p == head) { // Case 1
+        stats_.recolor();
         nd->black = true;
         nd->black_height++;
         return nd;
@@ -521,6 +644,8 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       NodeBase_* g = p->parent;
       NodeBase_* u = g->left == p ? g->right : g->left;
       if (!u || u->black) { // Case 4
+        stats_.rotate(1 + (nd == (p == g->left ? p->right : p->left)));
+        stats_.recolor(2);
         if (p == g->left) {
           if (nd == p->right) {
             std::swap(nd, p);
@@ -550,6 +675,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
         return IncreaseSize_(p->parent, head, sz);
       }
       // Case 3
+      stats_.recolor(3);
       p->size += sz; p->black = true; p->black_height++; Pull_(p);
       g->size += sz; g->black = false; Pull_(g);
       u->black = true; u->black_height++;
@@ -562,6 +688,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     NodeBase_* nd = nullptr;
     while (true) {
       if (!s->black) { // Case 2
+        stats_.rotate(); stats_.recolor(2);
         Push_(s);
         p->black = false; p->black_height--;
         s->black = true; s->black_height++;
@@ -583,6 +710,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       }
       if (p->black && (!s->left || s->left->black) &&
           (!s->right || s->right->black)) { // Case 3
+        stats_.recolor();
         s->black = false; s->black_height--;
         p->size--; p->black_height--; Pull_(p);
         nd = p; p = nd->parent;
@@ -596,6 +724,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     NodeBase_* sin = p->left == s ? s->right : s->left;
     NodeBase_* sout = p->left == s ? s->left : s->right;
     if (sout && !sout->black) { // Case 6
+      stats_.rotate(); stats_.recolor(3);
       Push_(s);
       sout->black = true; sout->black_height++;
       s->black_height += p->black;
@@ -612,6 +741,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       PullSize_(p); PullSizeNoCheck_(s);
       DecreaseSize_(s->parent);
     } else if (sin && !sin->black) { // Case 5
+      stats_.rotate(2); stats_.recolor(2);
       Push_(s); Push_(sin);
       p->black_height -= p->black;
       sin->black_height += 1 + p->black;
@@ -632,6 +762,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       PullSize_(p); PullSize_(s); PullSizeNoCheck_(sin);
       DecreaseSize_(sin->parent);
     } else { // Case 4, p is red here (or it will be Case 3)
+      stats_.recolor(2);
       s->black = false; s->black_height--;
       p->black = true;
       DecreaseSize_(p);
@@ -639,6 +770,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   }
 
   void InsertBefore_(NodeBase_* a, NodeBase_* b) {
+    stats_.operation();
     if (a != head_) {
       if (!a->left) {
         if (a == head_->parent) head_->parent = b;
@@ -659,12 +791,32 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     }
     InsertRepair_(b, head_);
   }
+  // exchanges the tree positions (links, color, size) of a and its
+  // successor b, the leftmost node of a's right subtree
+  static void SwapWithSuccessor_(NodeBase_* a, NodeBase_* b) {
+    NodeBase_ *al = a->left, *ar = a->right, *bp = b->parent, *br = b->right;
+    ConnectParentNoCheck_(a, b);
+    ConnectLeftNoCheck_(b, al);
+    if (ar == b) {
+      ConnectRightNoCheck_(b, a);
+    } else {
+      ConnectRightNoCheck_(b, ar);
+      ConnectLeftNoCheck_(bp, a);
+    }
+    a->left = nullptr;
+    ConnectRight_(a, br);
+    std::swap(a->black, b->black);
+    std::swap(a->black_height, b->black_height);
+    std::swap(a->size, b->size);
+  }
   NodeBase_* Remove_(NodeBase_* a) {
+    stats_.operation();
     if (a->left && a->right) {
+      // the successor takes a's place, so every other node keeps its value
+      // and iterators to them stay valid; a then has no left child
       NodeBase_* tmp = First_(a->right); // begin won't be affected
       PushTo_(tmp, head_);
-      using std::swap; swap(Sup_(tmp)->value, Sup_(a)->value);
-      a = tmp;
+      SwapWithSuccessor_(a, tmp);
     } else {
       PushTo_(a, head_);
       if (a == head_->parent) {
@@ -710,6 +862,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       return InsertRepair_(m, l->parent = nullptr);
     }
     if (l->black_height == r->black_height){
+      stats_.merge(0);
       ConnectLeftNoCheck_(m, l);
       ConnectRightNoCheck_(m, r);
       m->black = true; m->black_height = l->black_height + 1;
@@ -718,9 +871,11 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     }
     if (l->black_height < r->black_height) {
       NodeBase_* ret = r;
+      size_t depth = 0;
       for (; !r->black || l->black_height != r->black_height; r = r->left) {
-        Push_(r);
+        Push_(r); depth++;
       }
+      stats_.merge(depth);
       ConnectParentNoCheck_(r, m);
       ConnectLeftNoCheck_(m, l);
       ConnectRightNoCheck_(m, r);
@@ -730,9 +885,11 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
       return ret;
     } else {
       NodeBase_* ret = l;
+      size_t depth = 0;
       for (; !l->black || l->black_height != r->black_height; l = l->right) {
-        Push_(l);
+        Push_(l); depth++;
       }
+      stats_.merge(depth);
       ConnectParentNoCheck_(l, m);
       ConnectLeftNoCheck_(m, l);
       ConnectRightNoCheck_(m, r);
@@ -748,7 +905,8 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     left = nd->left; right = nd->right;
     PaintBlack_(left); PaintBlack_(right);
     if (pivot) right = Merge_(nullptr, nd, right);
-    while (p != head_) {
+    size_t depth = 0;
+    for (; p != head_; depth++) {
       bool is_left = p->left == nd;
       nd = p;
       p = p->parent;
@@ -760,18 +918,276 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
         left = Merge_(nd->left, nd, left);
       }
     }
+    stats_.split(depth);
   }
 
   void InsertMerge_(NodeBase_* nd, NodeBase_* head2) {
     if (!head_->left) head_->parent = nd;
     ConnectLeft_(head_, Merge_(head_->left, nd, head2->left));
-    head2->left = nullptr; head2->parent = head_;
+    head2->left = nullptr; head2->parent = head2;
+  }
+  // cut [a, b) out with two splits and one join; the rest stays under head_
+  // and the detached root of the range is returned
+  NodeBase_* Extract_(NodeBase_* a, NodeBase_* b) {
+    NodeBase_ *l, *r = nullptr, *mid;
+    if (b != head_) {
+      Split_(b, l, r, true);
+      PaintBlack_(l); PaintBlack_(r);
+      ConnectLeft_(head_, l);
+    }
+    Split_(a, l, mid, true);
+    PaintBlack_(l); PaintBlack_(mid);
+    NodeBase_* rest = Join_(l, r);
+    PaintBlack_(rest);
+    ConnectLeft_(head_, rest);
+    head_->parent = rest ? First_(rest) : head_;
+    return mid;
+  }
+
+  // Join-based set algorithms. They work on detached subtrees with black
+  // roots (the parent pointer of a root is ignored), consume their inputs and
+  // return the root of the result.
+  void Detach_(NodeBase_* nd, NodeBase_*& left, NodeBase_*& right) {
+    Push_(nd);
+    left = nd->left; right = nd->right;
+    PaintBlack_(left); PaintBlack_(right);
+  }
+  void FreeTree_(NodeBase_* nd) {
+    if (nd) ClearTree_(nd), FreeNode_(nd);
+  }
+  NodeBase_* SplitLast_(NodeBase_* nd, NodeBase_*& last) {
+    NodeBase_ *l, *r;
+    Detach_(nd, l, r);
+    if (!r) { last = nd; return l; }
+    r = SplitLast_(r, last);
+    return Merge_(l, nd, r);
+  }
+  NodeBase_* Join_(NodeBase_* l, NodeBase_* r) {
+    if (!l) return r;
+    if (!r) return l;
+    NodeBase_* m;
+    l = SplitLast_(l, m);
+    return Merge_(l, m, r);
+  }
+  template <class Compare>
+  void SplitKey_(NodeBase_* nd, const T& key, Compare& comp,
+                 NodeBase_*& left, NodeBase_*& right, NodeBase_*& eq) {
+    if (!nd) { left = right = eq = nullptr; return; }
+    NodeBase_ *l, *r;
+    Detach_(nd, l, r);
+    const T& val = Sup_(nd)->value;
+    if (comp(key, val)) {
+      SplitKey_(l, key, comp, left, l, eq);
+      right = Merge_(l, nd, r);
+    } else if (comp(val, key)) {
+      SplitKey_(r, key, comp, r, right, eq);
+      left = Merge_(l, nd, r);
+    } else {
+      left = l; right = r; eq = nd;
+    }
+  }
+
+  static const size_t kForkCutoff_ = 1 << 15;
+  // forking depth levels runs at most 2^depth <= threads leaves at once
+  static int ForkDepth_(unsigned threads) {
+    if (!threads) threads = std::thread::hardware_concurrency();
+    return threads > 1 ? std::__lg(threads) : 0;
+  }
+  template <class F, class G> static void ForkJoin_(bool fork, F&& f, G&& g) {
+    if (fork) {
+      std::future<void> done =
+          RBTreeBase_::Workers_::Instance().Run(std::packaged_task<void()>(std::ref(f)));
+      try {
+        g();
+      } catch (...) {
+        done.wait();
+        throw;
+      }
+      done.get();
+    } else {
+      f(); g();
+    }
+  }
+
+  // Nodes dropped by the set operations are buried (roots of dead subtrees
+  // chained through parent) and freed by the calling thread at the end, so
+  // forked halves never free into a worker thread's node pool.
+  static void Bury_(NodeBase_*& dead, NodeBase_* nd) {
+    if (!nd) return;
+    nd->parent = dead;
+    dead = nd;
+  }
+  static void BuryNode_(NodeBase_*& dead, NodeBase_* nd) {
+    nd->left = nd->right = nullptr;
+    Bury_(dead, nd);
+  }
+  static void Rebury_(NodeBase_*& dead, NodeBase_* list) {
+    for (NodeBase_* nxt; list; list = nxt) {
+      nxt = list->parent;
+      Bury_(dead, list);
+    }
+  }
+  void FreeBuried_(NodeBase_* dead) {
+    for (NodeBase_* nxt; dead; dead = nxt) {
+      nxt = dead->parent;
+      FreeTree_(dead);
+    }
+  }
+  // runs f(dead) and g(dead) through ForkJoin_; a forked f gets its own list
+  template <class F, class G> static void ForkJoinBury_(bool fork, NodeBase_*& dead, F&& f, G&& g) {
+    if (!fork) {
+      f(dead); g(dead);
+      return;
+    }
+    NodeBase_* fdead = nullptr;
+    ForkJoin_(true, [&]() { f(fdead); }, [&]() { g(dead); });
+    Rebury_(dead, fdead);
+  }
+
+  template <class Compare>
+  NodeBase_* Union_(NodeBase_* a, NodeBase_* b, Compare& comp, int depth, NodeBase_*& dead) {
+    if (!a) return b;
+    if (!b) return a;
+    bool fork = depth > 0 && a->size + b->size >= kForkCutoff_;
+    NodeBase_ *l1, *r1, *l2, *r2, *eq;
+    Detach_(a, l1, r1);
+    SplitKey_(b, Sup_(a)->value, comp, l2, r2, eq);
+    if (eq) BuryNode_(dead, eq);
+    ForkJoinBury_(fork, dead,
+        [&](NodeBase_*& d) { l1 = Union_(l1, l2, comp, depth - 1, d); },
+        [&](NodeBase_*& d) { r1 = Union_(r1, r2, comp, depth - 1, d); });
+    return Merge_(l1, a, r1);
+  }
+  template <class Compare>
+  NodeBase_* Intersect_(NodeBase_* a, NodeBase_* b, Compare& comp, int depth, NodeBase_*& dead) {
+    if (!a || !b) {
+      Bury_(dead, a); Bury_(dead, b);
+      return nullptr;
+    }
+    bool fork = depth > 0 && a->size + b->size >= kForkCutoff_;
+    NodeBase_ *l1, *r1, *l2, *r2, *eq;
+    Detach_(a, l1, r1);
+    SplitKey_(b, Sup_(a)->value, comp, l2, r2, eq);
+    ForkJoinBury_(fork, dead,
+        [&](NodeBase_*& d) { l1 = Intersect_(l1, l2, comp, depth - 1, d); },
+        [&](NodeBase_*& d) { r1 = Intersect_(r1, r2, comp, depth - 1, d); });
+    if (eq) {
+      BuryNode_(dead, eq);
+      return Merge_(l1, a, r1);
+    }
+    BuryNode_(dead, a);
+    return Join_(l1, r1);
+  }
+  template <class Compare>
+  NodeBase_* Difference_(NodeBase_* a, NodeBase_* b, Compare& comp, int depth, NodeBase_*& dead) {
+    if (!a || !b) {
+      Bury_(dead, b);
+      return a;
+    }
+    bool fork = depth > 0 && a->size + b->size >= kForkCutoff_;
+    NodeBase_ *l1, *r1, *l2, *r2, *eq;
+    Detach_(a, l1, r1);
+    SplitKey_(b, Sup_(a)->value, comp, l2, r2, eq);
+    ForkJoinBury_(fork, dead,
+        [&](NodeBase_*& d) { l1 = Difference_(l1, l2, comp, depth - 1, d); },
+        [&](NodeBase_*& d) { r1 = Difference_(r1, r2, comp, depth - 1, d); });
+    if (eq) {
+      BuryNode_(dead, eq); BuryNode_(dead, a);
+      return Join_(l1, r1);
+    }
+    return Merge_(l1, a, r1);
+  }
+  // left gets the prefix of elements satisfying pred, right the rest
+  template <class Pred>
+  void SplitBy_(NodeBase_* nd, Pred& pred, NodeBase_*& left, NodeBase_*& right) {
+    if (!nd) { left = right = nullptr; return; }
+    NodeBase_ *l, *r;
+    Detach_(nd, l, r);
+    if (pred(Sup_(nd)->value)) {
+      SplitBy_(r, pred, r, right);
+      left = Merge_(l, nd, r);
+    } else {
+      SplitBy_(l, pred, left, l);
+      right = Merge_(l, nd, r);
+    }
+  }
+  // below this many nodes MergeSorted_ inserts b's nodes one by one
+  static const size_t kMergeSortedLeaf_ = 8;
+  void Collect_(NodeBase_* nd, NodeBase_**& out) {
+    if (!nd) return;
+    Push_(nd);
+    Collect_(nd->left, out);
+    *out++ = nd;
+    Collect_(nd->right, out);
+  }
+  // plain descent into a detached subtree, after elements equal to nd
+  template <class Compare>
+  NodeBase_* InsertNode_(NodeBase_* root, NodeBase_* nd, Compare& comp) {
+    nd->left = nd->right = nullptr; nd->size = 1;
+    if (!root) {
+      nd->black = true; nd->black_height = 2; Pull_(nd);
+      return nd;
+    }
+    nd->black = false; nd->black_height = 1;
+    const T& val = Sup_(nd)->value;
+    NodeBase_* p = root;
+    root->parent = nullptr;
+    while (true) {
+      Push_(p);
+      if (comp(val, Sup_(p)->value)) {
+        if (!p->left) { ConnectLeftNoCheck_(p, nd); break; }
+        p = p->left;
+      } else {
+        if (!p->right) { ConnectRightNoCheck_(p, nd); break; }
+        p = p->right;
+      }
+    }
+    return InsertRepair_(nd, nullptr);
+  }
+  // union keeping duplicates; elements of b go after equal elements of a.
+  // Recursion stops as soon as either side is empty, so merging m elements
+  // into n costs O(m log(n/m + 1)).
+  template <class Compare>
+  NodeBase_* MergeSorted_(NodeBase_* a, NodeBase_* b, Compare& comp, int depth) {
+    if (!a) return b;
+    if (!b) return a;
+    if (b->size <= kMergeSortedLeaf_) {
+      // a few nodes left: descending is cheaper than splitting and joining
+      NodeBase_* buf[kMergeSortedLeaf_];
+      NodeBase_** end = buf;
+      Collect_(b, end);
+      for (NodeBase_** it = buf; it != end; ++it) a = InsertNode_(a, *it, comp);
+      return a;
+    }
+    bool fork = depth > 0 && a->size + b->size >= kForkCutoff_;
+    NodeBase_ *l1, *r1, *l2, *r2;
+    Detach_(a, l1, r1);
+    const T& key = Sup_(a)->value;
+    auto pred = [&](const T& x) { return comp(x, key); };
+    SplitBy_(b, pred, l2, r2);
+    ForkJoin_(fork, [&]() { l1 = MergeSorted_(l1, l2, comp, depth - 1); },
+                    [&]() { r1 = MergeSorted_(r1, r2, comp, depth - 1); });
+    return Merge_(l1, a, r1);
+  }
+  // insert_sorted inserts one by one below one element per
+  // kInsertSortedRatio_ of the tree, about where merging stops paying off
+  static const size_t kInsertSortedRatio_ = 256;
+  template <class Func> void SetOperation_(RBTree& tree, Func&& func) {
+    CheckAlloc_(tree);
+    NodeBase_ *a = head_->left, *b = tree.head_->left;
+    head_->left = tree.head_->left = nullptr;
+    head_->parent = head_; tree.head_->parent = tree.head_;
+    NodeBase_* root = func(a, b);
+    ConnectLeft_(head_, root);
+    if (root) head_->parent = First_(root);
   }
 
   template <class Pred> NodeBase_* PartitionBound_(Pred&& func) {
     // first element x that func(x) is false, assuming monotonicity
     NodeBase_ *now = head_->left, *last = head_;
+    stats_.operation();
     while (now) {
+      stats_.visit();
       Push_(now);
       const T& val = Sup_(now)->value; // just add constness
       if (func(val)) {
@@ -786,7 +1202,9 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   template <class Pred> NodeBase_* PartitionBoundIter_(Pred&& func) {
     // same as PartitionBound, but const_iterator is passed to func
     NodeBase_ *now = head_->left, *last = head_;
+    stats_.operation();
     while (now) {
+      stats_.visit();
       Push_(now);
       if (func(const_iterator(now))) {
         now = now->right;
@@ -798,29 +1216,66 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     return last;
   }
 
-  NodeType_* GenNode_(const T& val) const {
-    NodeType_* ptr = static_cast<NodeType_*>(malloc(sizeof(NodeType_)));
+  // aggregate of positions [l, r) of the subtree, 0 <= l < r <= nd->size;
+  // pending tags are folded in on the way up instead of being pushed
+  template <class U>
+  typename U::summary_type Query_(NodeBase_* nd, size_t l, size_t r) const {
+    typedef typename U::policy_type P;
+    const U& val = Sup_(nd)->value;
+    stats_.visit();
+    if (l == 0 && r == nd->size) return val.sum;
+    auto part = [&](NodeBase_* ch, size_t a, size_t b) {
+      typename U::summary_type ret = Query_<U>(ch, a, b);
+      if (val.tagged) P::apply(ret, val.tag, b - a);
+      return ret;
+    };
+    size_t ls = Size_(nd->left);
+    if (r <= ls) return part(nd->left, l, r);
+    if (l > ls) return part(nd->right, l - ls - 1, r - ls - 1);
+    typename U::summary_type ret = P::lift(val.value);
+    if (l < ls) ret = P::combine(part(nd->left, l, ls), ret);
+    if (r > ls + 1) ret = P::combine(ret, part(nd->right, 0, r - ls - 1));
+    return ret;
+  }
+  template <class U>
+  void Apply_(NodeBase_* nd, size_t l, size_t r, const typename U::tag_type& tag) {
+    stats_.visit();
+    if (l == 0 && r == nd->size) {
+      Sup_(nd)->value.apply(tag, nd->size);
+      return;
+    }
+    Push_(nd);
+    size_t ls = Size_(nd->left);
+    if (l < ls) Apply_<U>(nd->left, l, std::min(r, ls), tag);
+    if (l <= ls && ls < r) U::policy_type::apply(Sup_(nd)->value.value, tag);
+    if (r > ls + 1) Apply_<U>(nd->right, l > ls ? l - ls - 1 : 0, r - ls - 1, tag);
+    Pull_(nd);
+  }
+
+  NodeType_* AllocNode_() { return NodeAllocTraits_::allocate(alloc_, 1); }
+  NodeType_* GenNode_(const T& val) {
+    NodeType_* ptr = AllocNode_();
     new(ptr) NodeType_(val);
     return ptr;
   }
-  NodeType_* GenNode_(T&& val) const {
-    NodeType_* ptr = static_cast<NodeType_*>(malloc(sizeof(NodeType_)));
+  NodeType_* GenNode_(T&& val) {
+    NodeType_* ptr = AllocNode_();
     new(ptr) NodeType_(std::move(val));
     return ptr;
   }
-  NodeType_* GenNode_(NodeType_* x, NodeBase_* p) const {
-    NodeType_* ptr = static_cast<NodeType_*>(malloc(sizeof(NodeType_)));
+  NodeType_* GenNode_(NodeType_* x, NodeBase_* p) {
+    NodeType_* ptr = AllocNode_();
     new(ptr) NodeType_(x, p);
     return ptr;
   }
-  template <class... Args> NodeType_* GenNodeArgs_(Args&&... args) const {
-    NodeType_* ptr = static_cast<NodeType_*>(malloc(sizeof(NodeType_)));
+  template <class... Args> NodeType_* GenNodeArgs_(Args&&... args) {
+    NodeType_* ptr = AllocNode_();
     new(ptr) NodeType_(args...);
     return ptr;
   }
-  void FreeNode_(NodeBase_* nd) const {
+  void FreeNode_(NodeBase_* nd) {
     Sup_(nd)->value.~T();
-    free(nd);
+    NodeAllocTraits_::deallocate(alloc_, Sup_(nd), 1);
   }
 
   void ClearTree_(NodeBase_* nd) {
@@ -863,15 +1318,172 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     }
   }
 
+  // Binary image: a header, then one record per node in preorder
+  //   flags (1: left child, 2: right child, 4: black), black_height,
+  //   size (8 bytes), the raw bytes of T
+  // Values are stored as is, so aggregates and pending tags survive.
+  static const uint32_t kImageMagic_ = 0x31544252; // "RBT1"
+  static const size_t kImageBuf_ = 1 << 20;
+  static const size_t kRecord_ = 10 + sizeof(T);
+
+  bool Save_(FILE* f) const {
+    uint64_t header[2] = {(uint64_t)kImageMagic_ << 32 | sizeof(T), size()};
+    if (fwrite(header, sizeof(header), 1, f) != 1) return false;
+    char* buf = (char*)malloc(kImageBuf_);
+    if (!buf) return false;
+    char *now = buf, *end = buf + kImageBuf_ / kRecord_ * kRecord_;
+    bool ok = true;
+    for (NodeBase_* nd = head_->left; nd && ok; nd = PreorderNext_(nd)) {
+      if (nd == head_) break;
+      uint64_t sz = nd->size;
+      now[0] = (nd->left ? 1 : 0) | (nd->right ? 2 : 0) | (nd->black ? 4 : 0);
+      now[1] = nd->black_height;
+      memcpy(now + 2, &sz, 8);
+      memcpy(now + 10, &Sup_(nd)->value, sizeof(T));
+      if ((now += kRecord_) == end) {
+        ok = fwrite(buf, 1, now - buf, f) == (size_t)(now - buf);
+        now = buf;
+      }
+    }
+    if (ok && now != buf) ok = fwrite(buf, 1, now - buf, f) == (size_t)(now - buf);
+    free(buf);
+    return ok;
+  }
+  // sizes and colors come from the file, so the loaded shape is checked
+  // bottom-up before anything relies on them
+  bool CheckImage_() const {
+    if (!head_->left->black) return false;
+    for (NodeBase_* nd = PostorderFirst_(head_->left); nd != head_; nd = PostorderNext_(nd)) {
+      NodeBase_ *l = nd->left, *r = nd->right;
+      size_t lh = l ? l->black_height : 1, rh = r ? r->black_height : 1;
+      if (nd->size != Size_(l) + Size_(r) + 1) return false;
+      if (lh != rh || nd->black_height != lh + nd->black) return false;
+      if (!nd->black && ((l && !l->black) || (r && !r->black))) return false;
+    }
+    return true;
+  }
+  bool Load_(FILE* f) {
+    uint64_t header[2];
+    if (fread(header, sizeof(header), 1, f) != 1) return false;
+    if (header[0] != ((uint64_t)kImageMagic_ << 32 | sizeof(T))) return false;
+    uint64_t n = header[1], cnt = 0;
+    if (!n) return true;
+    char* buf = (char*)malloc(kImageBuf_);
+    if (!buf) return false;
+    char *now = buf, *end = buf;
+    NodeBase_* pending[128]; // nodes whose right child comes later
+    int top = 0;
+    NodeBase_* p = head_;
+    bool left = true;
+    while (cnt < n) {
+      if ((size_t)(end - now) < kRecord_) {
+        size_t rest = end - now;
+        memmove(buf, now, rest);
+        end = buf + rest + fread(buf + rest, 1, kImageBuf_ - rest, f);
+        now = buf;
+        if ((size_t)(end - now) < kRecord_) break;
+      }
+      NodeType_* nd = AllocNode_();
+      new(static_cast<NodeBase_*>(nd)) NodeBase_();
+      uint64_t sz;
+      memcpy(&sz, now + 2, 8);
+      memcpy((void*)&nd->value, now + 10, sizeof(T));
+      nd->size = sz;
+      nd->black = now[0] & 4;
+      nd->black_height = now[1];
+      if (left) {
+        ConnectLeftNoCheck_(p, nd);
+      } else {
+        ConnectRightNoCheck_(p, nd);
+      }
+      if (now[0] & 1) {
+        if (now[0] & 2) pending[top++] = nd;
+        p = nd; left = true;
+      } else if (now[0] & 2) {
+        p = nd; left = false;
+      } else if (top) {
+        p = pending[--top]; left = false;
+      } else {
+        p = nullptr;
+      }
+      now += kRecord_;
+      if (++cnt, !p || top == 128) break;
+    }
+    free(buf);
+    if (head_->left) head_->parent = First_(head_->left);
+    if (cnt != n || p || !CheckImage_()) { // truncated or malformed
+      ClearTree_();
+      return false;
+    }
+    return true;
+  }
+
+  template <class Iter>
+  NodeBase_* BuildTree_(Iter& first, size_t n, int depth, int red_depth) {
+    // balanced in-order build; only the last (possibly partial) level is red
+    if (!n) return nullptr;
+    NodeBase_* l = BuildTree_(first, (n - 1) / 2, depth + 1, red_depth);
+    NodeBase_* nd = GenNode_(*first);
+    ++first;
+    NodeBase_* r = BuildTree_(first, n - 1 - (n - 1) / 2, depth + 1, red_depth);
+    ConnectLeft_(nd, l);
+    ConnectRight_(nd, r);
+    nd->size = n;
+    nd->black = !depth || depth < red_depth;
+    nd->black_height = (r ? r->black_height : 1) + nd->black;
+    Pull_(nd);
+    return nd;
+  }
+  template <class Iter> void Assign_(Iter first, Iter last) {
+    Assign_(first, last, typename std::iterator_traits<Iter>::iterator_category());
+  }
+  // a single-pass range can't be counted first, so it is appended one by one
+  template <class Iter> void Assign_(Iter first, Iter last, std::input_iterator_tag) {
+    for (; first != last; ++first) InsertBefore_(head_, GenNode_(*first));
+  }
+  template <class Iter> void Assign_(Iter first, Iter last, std::forward_iterator_tag) {
+    size_t n = std::distance(first, last);
+    if (!n) return;
+    ConnectLeftNoCheck_(head_, BuildTree_(first, n, 0, std::__lg(n)));
+    head_->parent = First_(head_->left);
+  }
+
   void Init_() {
     head_ = static_cast<NodeBase_*>(malloc(sizeof(NodeBase_)));
     new(head_) NodeBase_();
     head_->parent = head_; head_->black_height = 0;
   }
 
+  // nodes may only move between trees whose allocators free each other's
+  // blocks
+  void CheckAlloc_(const RBTree& tree) const {
+    if (!NodeAllocTraits_::is_always_equal::value && !(alloc_ == tree.alloc_))
+      throw std::invalid_argument("RBTree: allocators differ");
+  }
+  void CopyAlloc_(const RBTree& tree, std::true_type) { alloc_ = tree.alloc_; }
+  void CopyAlloc_(const RBTree&, std::false_type) {}
+  void MoveAssign_(RBTree& tree, std::true_type) {
+    ClearTree_();
+    std::swap(head_, tree.head_);
+    alloc_ = std::move(tree.alloc_);
+  }
+  void MoveAssign_(RBTree& tree, std::false_type) {
+    if (alloc_ == tree.alloc_) {
+      std::swap(head_, tree.head_);
+      return;
+    }
+    ClearTree_();
+    Assign_(std::make_move_iterator(tree.begin()), std::make_move_iterator(tree.end()));
+    tree.ClearTree_();
+  }
+  void SwapAlloc_(RBTree& tree, std::true_type) { std::swap(alloc_, tree.alloc_); }
+  void SwapAlloc_(RBTree&, std::false_type) {}
+
   NodeBase_* head_;
   PullFunc pull_func_;
   PushFunc push_func_;
+  mutable Stats stats_;
+  NodeAlloc_ alloc_;
  public:
   typedef T value_type;
   typedef T& reference;
@@ -884,28 +1496,41 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   typedef RBTreePostorderIterator<T> postorder_iterator;
   typedef std::reverse_iterator<iterator> reverse_iterator;
   typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+  typedef Alloc allocator_type;
 
   RBTree() { Init_(); }
-  RBTree(const RBTree& tree) {
+  explicit RBTree(const allocator_type& alloc) : alloc_(alloc) { Init_(); }
+  RBTree(const RBTree& tree)
+      : alloc_(NodeAllocTraits_::select_on_container_copy_construction(tree.alloc_)) {
     Init_();
     CopyTree_(head_, tree.head_);
+    head_->parent = First_(head_);
   }
-  RBTree(RBTree&& tree) {
+  RBTree(RBTree&& tree) : alloc_(std::move(tree.alloc_)) {
     Init_();
     std::swap(head_, tree.head_);
   }
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  RBTree(Iter first, Iter last) {
+    Init_();
+    Assign_(first, last);
+  }
   ~RBTree() {
     ClearTree_();
     free(head_);
   }
 
   RBTree& operator=(const RBTree& tree) {
+    if (this == &tree) return *this;
     ClearTree_();
+    CopyAlloc_(tree, typename NodeAllocTraits_::propagate_on_container_copy_assignment());
     CopyTree_(head_, tree.head_);
+    head_->parent = First_(head_);
     return *this;
   }
   RBTree& operator=(RBTree&& tree) {
-    std::swap(head_, tree.head_);
+    if (this != &tree)
+      MoveAssign_(tree, typename NodeAllocTraits_::propagate_on_container_move_assignment());
     return *this;
   }
 
@@ -951,7 +1576,9 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   }
   reference at(size_type x) {
     NodeBase_* nd = head_->left;
+    stats_.operation();
     while (true) {
+      stats_.visit();
       Push_(nd);
       if (Size_(nd->left) == x) break;
       if (Size_(nd->left) > x) {
@@ -974,6 +1601,20 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     return PartitionBoundIter_(func);
   }
 
+  // Range aggregate and lazy range update in one descent, for T laid out
+  // as MonoidNode (see RBTreeMonoid.h) with MonoidPull / MonoidPush.
+  // query does not write to the tree, so concurrent queries are safe.
+  template <class U = T>
+  typename U::summary_type query(size_type l, size_type r) const {
+    if (l >= r) return U::policy_type::identity();
+    stats_.operation();
+    return Query_<U>(head_->left, l, r);
+  }
+  template <class U = T>
+  void apply(size_type l, size_type r, const typename U::tag_type& tag) {
+    if (l < r) stats_.operation(), Apply_<U>(head_->left, l, r, tag);
+  }
+
   void push_back(const T& val) {
     InsertBefore_(head_, GenNode_(val));
   }
@@ -1010,19 +1651,70 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     return ptr;
   }
   void erase(iterator it) { FreeNode_(Remove_(it.ptr_)); }
+  // O(log n) restructuring, then the range is freed in one pass without
+  // rebalancing; iterators outside [first, last) stay valid
+  iterator erase(iterator first, iterator last) {
+    if (first != last) FreeTree_(Extract_(first.ptr_, last.ptr_));
+    return last;
+  }
+  // moves [first, last) into a new tree in O(log n); the new tree gets a
+  // copy of the allocator, which must compare equal to it
+  RBTree extract(iterator first, iterator last) {
+    RBTree ret(get_allocator());
+    ret.CheckAlloc_(*this);
+    if (first != last) {
+      ConnectLeft_(ret.head_, Extract_(first.ptr_, last.ptr_));
+      ret.head_->parent = first.ptr_;
+    }
+    return ret;
+  }
   void clear() { ClearTree_(); }
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  void assign(Iter first, Iter last) {
+    ClearTree_();
+    Assign_(first, last);
+  }
 
-  void swap(RBTree& x) { std::swap(head_, x.head_); }
+  // Binary image of the exact tree shape for trivially copyable T. load reads
+  // the file sequentially and links nodes as they come, with no comparisons
+  // or rebalancing; on failure the tree is left empty.
+  bool save(const char* path) const {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = Save_(f);
+    return fclose(f) == 0 && ok;
+  }
+  bool load(const char* path) {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    ClearTree_();
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    bool ok = Load_(f);
+    fclose(f);
+    return ok;
+  }
+
+  void swap(RBTree& x) {
+    std::swap(head_, x.head_);
+    SwapAlloc_(x, typename NodeAllocTraits_::propagate_on_container_swap());
+  }
+  // The operations below move nodes between *this and tree, so both must use
+  // equal allocators; std::invalid_argument is thrown otherwise.
   void insert_merge(RBTree& tree, const T& val) {
+    CheckAlloc_(tree);
     InsertMerge_(GenNode_(val), tree.head_);
   }
   void insert_merge(RBTree& tree, T&& val) {
+    CheckAlloc_(tree);
     InsertMerge_(GenNode_(std::move(val)), tree.head_);
   }
   template <class... Args> void emplace_merge(RBTree& tree, Args&&... args) {
+    CheckAlloc_(tree);
     InsertMerge_(GenNodeArgs_(args...), tree.head_);
   }
   void merge(RBTree& tree) {
+    CheckAlloc_(tree);
     if (tree.empty()) return;
     if (empty()) { std::swap(head_, tree.head_); return; }
     NodeBase_* pivot = (tree.head_->left->size < head_->left->size) ?
@@ -1030,6 +1722,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     InsertMerge_(pivot, tree.head_);
   }
   void erase_split(iterator it, RBTree& tree) {
+    CheckAlloc_(tree);
     NodeBase_ *l, *r = Next_(it.ptr_);
     tree.ClearTree_();
     if (it.ptr_ == head_->parent) head_->parent = head_;
@@ -1040,6 +1733,7 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     ConnectLeft_(tree.head_, r);
   }
   void split(iterator it, RBTree& tree) {
+    CheckAlloc_(tree);
     tree.ClearTree_();
     if (it.ptr_ == head_) return;
     NodeBase_ *l, *r;
@@ -1050,6 +1744,78 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
     ConnectLeft_(tree.head_, r);
   }
 
+  // Set operations on two trees sorted under comp, each without duplicates.
+  // The result is stored in *this and tree is left empty; for equal elements
+  // the one from *this is kept. Large inputs are processed by up to `threads`
+  // threads (0 means hardware concurrency), so comp, PullFunc and PushFunc
+  // must be safe to call concurrently.
+  template <class Compare>
+  void set_union(RBTree& tree, Compare comp, unsigned threads = 0) {
+    int depth = ForkDepth_(threads);
+    SetOperation_(tree, [&](NodeBase_* a, NodeBase_* b) {
+      NodeBase_* dead = nullptr;
+      NodeBase_* ret = Union_(a, b, comp, depth, dead);
+      FreeBuried_(dead);
+      return ret;
+    });
+  }
+  template <class Compare>
+  void set_intersection(RBTree& tree, Compare comp, unsigned threads = 0) {
+    int depth = ForkDepth_(threads);
+    SetOperation_(tree, [&](NodeBase_* a, NodeBase_* b) {
+      NodeBase_* dead = nullptr;
+      NodeBase_* ret = Intersect_(a, b, comp, depth, dead);
+      FreeBuried_(dead);
+      return ret;
+    });
+  }
+  template <class Compare>
+  void set_difference(RBTree& tree, Compare comp, unsigned threads = 0) {
+    int depth = ForkDepth_(threads);
+    SetOperation_(tree, [&](NodeBase_* a, NodeBase_* b) {
+      NodeBase_* dead = nullptr;
+      NodeBase_* ret = Difference_(a, b, comp, depth, dead);
+      FreeBuried_(dead);
+      return ret;
+    });
+  }
+  // Multiset merge of two trees sorted under comp (duplicates allowed);
+  // elements of tree go after equal elements of *this, tree is left empty.
+  // Large merges are forked over up to `threads` threads (0 means hardware
+  // concurrency) as in set_union.
+  template <class Compare> void merge_sorted(RBTree& tree, Compare comp, unsigned threads = 0) {
+    int depth = ForkDepth_(threads);
+    SetOperation_(tree, [&](NodeBase_* a, NodeBase_* b) {
+      return MergeSorted_(a, b, comp, depth);
+    });
+  }
+  // Insert a sorted range: the batch is built as a balanced tree in O(m)
+  // and merged in with merge_sorted. A batch that is small next to the
+  // tree is inserted element by element instead, which is faster there.
+  template <class Iter, class Compare>
+  void insert_sorted(Iter first, Iter last, Compare comp, unsigned threads = 0) {
+    // a single-pass range can't be counted, so it is inserted one by one
+    bool counted = std::is_base_of<std::forward_iterator_tag,
+        typename std::iterator_traits<Iter>::iterator_category>::value;
+    size_t n = counted ? std::distance(first, last) : 0;
+    if (!counted || size() > kInsertSortedRatio_ * n) {
+      for (; first != last; ++first) {
+        const T& val = *first;
+        NodeBase_* pos = PartitionBound_([&](const T& x) { return !comp(val, x); });
+        InsertBefore_(pos, GenNode_(val));
+      }
+      return;
+    }
+    if (!n) return;
+    // the batch is built from this tree's allocator, so no allocator check
+    NodeBase_* b = BuildTree_(first, n, 0, std::__lg(n));
+    NodeBase_* a = head_->left;
+    head_->left = nullptr;
+    NodeBase_* root = MergeSorted_(a, b, comp, ForkDepth_(threads));
+    ConnectLeft_(head_, root);
+    head_->parent = First_(root);
+  }
+
   void pull_node(iterator it) { Pull_(it.ptr_); }
   void push_node(iterator it) { Push_(it.ptr_); }
   void pull_from(iterator it) { PullFrom_(it.ptr_); }
@@ -1059,9 +1825,15 @@ template <class T, class PullFunc = Nop, class PushFunc = Nop> class RBTree {
   PushFunc& get_push_object() { return push_func_; }
   const PullFunc& get_pull_object() const { return pull_func_; }
   const PushFunc& get_push_object() const { return push_func_; }
+  allocator_type get_allocator() const { return allocator_type(alloc_); }
+
+  // counters of the Stats policy (empty for RBTreeNoStats)
+  typename Stats::snapshot_type stats() const { return stats_.snapshot(); }
+  void reset_stats() { stats_.reset(); }
 };
 
-template <class T, class U> void swap(RBTree<T, U>& a, RBTree<T, U>& b) {
+template <class T, class U, class V, class A, class S>
+void swap(RBTree<T, U, V, A, S>& a, RBTree<T, U, V, A, S>& b) {
   a.swap(b);
 }
 
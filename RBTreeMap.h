@@ -0,0 +1,321 @@
+#ifndef RBTREEMAP_H_
+#define RBTREEMAP_H_
+
+#include <functional>
+#include <utility>
+#include "RBTree.h"
+
+// Ordered containers with unique keys on top of RBTree. Subtree sizes are
+// kept, so rank queries (order_of_key / find_by_order) are O(log n).
+// Comparators that define is_transparent enable heterogeneous lookup.
+
+namespace RBTreeMapBase_ {
+
+template <class T> struct Self_ {
+  const T& operator()(const T& a) const { return a; }
+};
+template <class Key, class T> struct First_ {
+  const Key& operator()(const std::pair<const Key, T>& a) const { return a.first; }
+};
+
+// Value is the stored type and KeyOf extracts its key; the set passes
+// kConst = true to expose only const iterators
+template <class Key, class Value, class KeyOf, class Compare, class Alloc, bool kConst>
+class Ordered_ : protected RBTree<Value, Nop, Nop, Alloc> {
+ protected:
+  typedef RBTree<Value, Nop, Nop, Alloc> Base_;
+  typedef typename Base_::NodeBase_ NodeBase_;
+  using Base_::head_;
+  using Base_::Sup_;
+  using Base_::GenNode_;
+  using Base_::GenNodeArgs_;
+
+  const Key& KeyOf_(NodeBase_* nd) const { return keyof_(Sup_(nd)->value); }
+
+  template <class K> NodeBase_* LowerBound_(const K& key) const {
+    NodeBase_ *now = head_->left, *last = head_;
+    while (now) {
+      if (comp_(KeyOf_(now), key)) {
+        now = now->right;
+      } else {
+        last = now;
+        now = now->left;
+      }
+    }
+    return last;
+  }
+  template <class K> NodeBase_* UpperBound_(const K& key) const {
+    NodeBase_ *now = head_->left, *last = head_;
+    while (now) {
+      if (!comp_(key, KeyOf_(now))) {
+        now = now->right;
+      } else {
+        last = now;
+        now = now->left;
+      }
+    }
+    return last;
+  }
+  template <class K> NodeBase_* Find_(const K& key) const {
+    NodeBase_* nd = LowerBound_(key);
+    return nd == head_ || comp_(key, KeyOf_(nd)) ? head_ : nd;
+  }
+  template <class K> size_t OrderOfKey_(const K& key) const {
+    // number of elements less than key
+    NodeBase_* now = head_->left;
+    size_t ret = 0;
+    while (now) {
+      if (comp_(KeyOf_(now), key)) {
+        ret += RBTreeBase_::Size_(now->left) + 1;
+        now = now->right;
+      } else {
+        now = now->left;
+      }
+    }
+    return ret;
+  }
+
+  // link a fresh node as the `right` or left child of leaf position p
+  void Link_(NodeBase_* p, bool right, NodeBase_* nd) {
+    if (p == head_) {
+      head_->parent = nd;
+      RBTreeBase_::ConnectLeftNoCheck_(head_, nd);
+    } else if (right) {
+      RBTreeBase_::ConnectRightNoCheck_(p, nd);
+    } else {
+      if (p == head_->parent) head_->parent = nd;
+      RBTreeBase_::ConnectLeftNoCheck_(p, nd);
+    }
+    this->InsertRepair_(nd, head_);
+  }
+  // single descent: either finds key or links the node built by make
+  template <class K, class Make>
+  std::pair<NodeBase_*, bool> InsertUnique_(const K& key, Make&& make) {
+    NodeBase_ *now = head_->left, *p = head_, *last = head_;
+    bool right = false;
+    while (now) {
+      p = now;
+      if ((right = comp_(KeyOf_(now), key))) {
+        now = now->right;
+      } else {
+        last = now;
+        now = now->left;
+      }
+    }
+    if (last != head_ && !comp_(key, KeyOf_(last))) return {last, false};
+    NodeBase_* nd = make();
+    Link_(p, right, nd);
+    return {nd, true};
+  }
+  // the hint is used when key belongs right before it; this needs O(1)
+  // comparisons, which makes appending sorted keys with hint end() cheap
+  template <class K, class Make>
+  std::pair<NodeBase_*, bool> InsertHint_(NodeBase_* hint, const K& key, Make&& make) {
+    if (hint == head_ || comp_(key, KeyOf_(hint))) {
+      NodeBase_* prv = hint == head_->parent ? head_ : RBTreeBase_::Prev_(hint);
+      if (prv == head_ || comp_(KeyOf_(prv), key)) {
+        NodeBase_* nd = make();
+        if (!hint->left) {
+          Link_(hint, false, nd);
+        } else {
+          Link_(prv, true, nd); // prv is the last node of hint's left subtree
+        }
+        return {nd, true};
+      }
+    }
+    return InsertUnique_(key, make);
+  }
+
+  Compare comp_;
+  KeyOf keyof_;
+ public:
+  typedef Key key_type;
+  typedef Value value_type;
+  typedef Compare key_compare;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef typename std::conditional<kConst, typename Base_::const_iterator,
+                                    typename Base_::iterator>::type iterator;
+  typedef typename Base_::const_iterator const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+  typedef Alloc allocator_type;
+
+  explicit Ordered_(const Compare& comp = Compare()) : comp_(comp) {}
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  Ordered_(Iter first, Iter last, const Compare& comp = Compare()) : comp_(comp) {
+    insert(first, last);
+  }
+
+  iterator begin() { return Base_::begin(); }
+  const_iterator begin() const { return Base_::begin(); }
+  const_iterator cbegin() const { return Base_::begin(); }
+  iterator end() { return Base_::end(); }
+  const_iterator end() const { return Base_::end(); }
+  const_iterator cend() const { return Base_::end(); }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+  using Base_::empty;
+  using Base_::size;
+  using Base_::clear;
+  key_compare key_comp() const { return comp_; }
+
+  iterator find(const Key& key) { return Base_::Iter_(Find_(key)); }
+  const_iterator find(const Key& key) const { return Base_::ConstIter_(Find_(key)); }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator find(const K& key) {
+    return Base_::Iter_(Find_(key));
+  }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator find(const K& key) const {
+    return Base_::ConstIter_(Find_(key));
+  }
+  size_type count(const Key& key) const { return Find_(key) != head_; }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  size_type count(const K& key) const {
+    return Find_(key) != head_;
+  }
+
+  iterator lower_bound(const Key& key) { return Base_::Iter_(LowerBound_(key)); }
+  const_iterator lower_bound(const Key& key) const { return Base_::ConstIter_(LowerBound_(key)); }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator lower_bound(const K& key) {
+    return Base_::Iter_(LowerBound_(key));
+  }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& key) const {
+    return Base_::ConstIter_(LowerBound_(key));
+  }
+  iterator upper_bound(const Key& key) { return Base_::Iter_(UpperBound_(key)); }
+  const_iterator upper_bound(const Key& key) const { return Base_::ConstIter_(UpperBound_(key)); }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  iterator upper_bound(const K& key) {
+    return Base_::Iter_(UpperBound_(key));
+  }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& key) const {
+    return Base_::ConstIter_(UpperBound_(key));
+  }
+  std::pair<iterator, iterator> equal_range(const Key& key) {
+    NodeBase_* nd = Find_(key);
+    if (nd == head_) return {Base_::Iter_(LowerBound_(key)), Base_::Iter_(LowerBound_(key))};
+    return {Base_::Iter_(nd), Base_::Iter_(RBTreeBase_::Next_(nd))};
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+    NodeBase_* nd = Find_(key);
+    if (nd == head_) return {Base_::ConstIter_(LowerBound_(key)), Base_::ConstIter_(LowerBound_(key))};
+    return {Base_::ConstIter_(nd), Base_::ConstIter_(RBTreeBase_::Next_(nd))};
+  }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& key) {
+    return {lower_bound<K>(key), upper_bound<K>(key)};
+  }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K& key) const {
+    return {lower_bound<K>(key), upper_bound<K>(key)};
+  }
+
+  // rank queries
+  size_type order_of_key(const Key& key) const { return OrderOfKey_(key); }
+  template <class K, class C = Compare, class = typename C::is_transparent>
+  size_type order_of_key(const K& key) const {
+    return OrderOfKey_(key);
+  }
+  iterator find_by_order(size_type x) {
+    return x < size() ? Base_::Iter_(RBTreeBase_::Select_(head_->left, x)) : end();
+  }
+  const_iterator find_by_order(size_type x) const {
+    return x < size() ? Base_::ConstIter_(RBTreeBase_::Select_(head_->left, x)) : end();
+  }
+
+  std::pair<iterator, bool> insert(const value_type& val) {
+    auto ret = InsertUnique_(keyof_(val), [&]() { return GenNode_(val); });
+    return {Base_::Iter_(ret.first), ret.second};
+  }
+  std::pair<iterator, bool> insert(value_type&& val) {
+    auto ret = InsertUnique_(keyof_(val), [&]() { return GenNode_(std::move(val)); });
+    return {Base_::Iter_(ret.first), ret.second};
+  }
+  iterator insert(const_iterator hint, const value_type& val) {
+    return Base_::Iter_(InsertHint_(Base_::Ptr_(hint), keyof_(val),
+                                    [&]() { return GenNode_(val); }).first);
+  }
+  iterator insert(const_iterator hint, value_type&& val) {
+    return Base_::Iter_(InsertHint_(Base_::Ptr_(hint), keyof_(val),
+                                    [&]() { return GenNode_(std::move(val)); }).first);
+  }
+  template <class Iter> void insert(Iter first, Iter last) {
+    for (; first != last; ++first) insert(end(), *first);
+  }
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args) {
+    NodeBase_* nd = GenNodeArgs_(std::forward<Args>(args)...);
+    auto ret = InsertUnique_(KeyOf_(nd), [&]() { return nd; });
+    if (!ret.second) this->FreeNode_(nd);
+    return {Base_::Iter_(ret.first), ret.second};
+  }
+  template <class... Args> iterator emplace_hint(const_iterator hint, Args&&... args) {
+    NodeBase_* nd = GenNodeArgs_(std::forward<Args>(args)...);
+    auto ret = InsertHint_(Base_::Ptr_(hint), KeyOf_(nd), [&]() { return nd; });
+    if (!ret.second) this->FreeNode_(nd);
+    return Base_::Iter_(ret.first);
+  }
+
+  // returns the element after it; other iterators stay valid
+  iterator erase(const_iterator it) {
+    NodeBase_* nd = Base_::Ptr_(it);
+    NodeBase_* nxt = RBTreeBase_::Next_(nd);
+    this->FreeNode_(this->Remove_(nd));
+    return Base_::Iter_(nxt);
+  }
+  size_type erase(const Key& key) {
+    NodeBase_* nd = Find_(key);
+    if (nd == head_) return 0;
+    this->FreeNode_(this->Remove_(nd));
+    return 1;
+  }
+
+  void swap(Ordered_& x) {
+    Base_::swap(x);
+    std::swap(comp_, x.comp_);
+  }
+};
+
+} // namespace RBTreeMapBase_
+
+template <class Key, class T, class Compare = std::less<Key>,
+          class Alloc = allocator<std::pair<const Key, T>>>
+class RBTreeMap : public RBTreeMapBase_::Ordered_<Key, std::pair<const Key, T>,
+    RBTreeMapBase_::First_<Key, T>, Compare, Alloc, false> {
+  typedef RBTreeMapBase_::Ordered_<Key, std::pair<const Key, T>,
+      RBTreeMapBase_::First_<Key, T>, Compare, Alloc, false> Base_;
+ public:
+  typedef T mapped_type;
+  using Base_::Base_;
+
+  T& operator[](const Key& key) {
+    return this->Sup_(this->InsertUnique_(key, [&]() {
+      return this->GenNodeArgs_(std::piecewise_construct,
+                                std::forward_as_tuple(key), std::forward_as_tuple());
+    }).first)->value.second;
+  }
+  T& operator[](Key&& key) {
+    return this->Sup_(this->InsertUnique_(key, [&]() {
+      return this->GenNodeArgs_(std::piecewise_construct,
+                                std::forward_as_tuple(std::move(key)), std::forward_as_tuple());
+    }).first)->value.second;
+  }
+};
+
+template <class Key, class Compare = std::less<Key>, class Alloc = allocator<Key>>
+class RBTreeSet : public RBTreeMapBase_::Ordered_<Key, Key,
+    RBTreeMapBase_::Self_<Key>, Compare, Alloc, true> {
+  typedef RBTreeMapBase_::Ordered_<Key, Key,
+      RBTreeMapBase_::Self_<Key>, Compare, Alloc, true> Base_;
+ public:
+  using Base_::Base_;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef RBTREEMONOID_H_
+#define RBTREEMONOID_H_
+
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include "RBTree.h"
+
+// Ready-made aggregates for RBTree::query / RBTree::apply.
+//
+// A policy describes a monoid of summaries over value_type together with
+// lazy tags acting on it:
+//   identity()            neutral summary
+//   lift(v)               summary of one element
+//   combine(a, b)         summary of a followed by b
+//   apply(v, t)           update one element by tag t
+//   apply(s, t, n)        update the summary of n elements by tag t
+//   compose(old, t)       old becomes "old, then t"
+// Use MonoidRBTree<Policy> (or RBTree<MonoidNode<Policy>, MonoidPull,
+// MonoidPush>) to get a sequence with O(log n) range query and update.
+// PersistentRBTree<MonoidNode<Policy>, MonoidPull, MonoidPush> keeps the
+// same summaries, read through root()->sum.
+
+template <class V> struct RangeAddSum {
+  typedef V value_type;
+  typedef V summary_type;
+  typedef V tag_type;
+  static summary_type identity() { return V(); }
+  static summary_type lift(const V& v) { return v; }
+  static summary_type combine(const V& a, const V& b) { return a + b; }
+  static summary_type repeat(const V& s, size_t n) { return s * static_cast<V>(n); }
+  static void apply(V& v, const V& t) { v += t; }
+  static void apply(V& s, const V& t, size_t n) { s += t * static_cast<V>(n); }
+  static void compose(V& old, const V& t) { old += t; }
+};
+
+template <class V> struct RangeAddMin {
+  typedef V value_type;
+  typedef V summary_type;
+  typedef V tag_type;
+  static summary_type identity() { return std::numeric_limits<V>::max(); }
+  static summary_type lift(const V& v) { return v; }
+  static summary_type combine(const V& a, const V& b) { return b < a ? b : a; }
+  static summary_type repeat(const V& s, size_t) { return s; }
+  static void apply(V& v, const V& t) { v += t; }
+  static void apply(V& s, const V& t, size_t) { s += t; }
+  static void compose(V& old, const V& t) { old += t; }
+};
+
+template <class V> struct RangeAddMax {
+  typedef V value_type;
+  typedef V summary_type;
+  typedef V tag_type;
+  static summary_type identity() { return std::numeric_limits<V>::lowest(); }
+  static summary_type lift(const V& v) { return v; }
+  static summary_type combine(const V& a, const V& b) { return a < b ? b : a; }
+  static summary_type repeat(const V& s, size_t) { return s; }
+  static void apply(V& v, const V& t) { v += t; }
+  static void apply(V& s, const V& t, size_t) { s += t; }
+  static void compose(V& old, const V& t) { old += t; }
+};
+
+// sum under x -> first * x + second
+template <class V> struct RangeAffineSum {
+  typedef V value_type;
+  typedef V summary_type;
+  typedef std::pair<V, V> tag_type;
+  static summary_type identity() { return V(); }
+  static summary_type lift(const V& v) { return v; }
+  static summary_type combine(const V& a, const V& b) { return a + b; }
+  static summary_type repeat(const V& s, size_t n) { return s * static_cast<V>(n); }
+  static void apply(V& v, const tag_type& t) { v = t.first * v + t.second; }
+  static void apply(V& s, const tag_type& t, size_t n) {
+    s = t.first * s + t.second * static_cast<V>(n);
+  }
+  static void compose(tag_type& old, const tag_type& t) {
+    old.second = t.first * old.second + t.second;
+    old.first = t.first * old.first;
+  }
+};
+
+// any of the above (or a user policy providing repeat) with assignment as
+// the tag: apply(l, r, v) sets every element in [l, r) to v
+template <class Monoid> struct RangeAssign {
+  typedef typename Monoid::value_type value_type;
+  typedef typename Monoid::summary_type summary_type;
+  typedef value_type tag_type;
+  static summary_type identity() { return Monoid::identity(); }
+  static summary_type lift(const value_type& v) { return Monoid::lift(v); }
+  static summary_type combine(const summary_type& a, const summary_type& b) {
+    return Monoid::combine(a, b);
+  }
+  static void apply(value_type& v, const tag_type& t) { v = t; }
+  static void apply(summary_type& s, const tag_type& t, size_t n) {
+    s = Monoid::repeat(Monoid::lift(t), n);
+  }
+  static void compose(tag_type& old, const tag_type& t) { old = t; }
+};
+
+// sum already includes the pending tag, which is only owed to the children
+template <class Policy> struct MonoidNode {
+  typedef Policy policy_type;
+  typedef typename Policy::value_type value_type;
+  typedef typename Policy::summary_type summary_type;
+  typedef typename Policy::tag_type tag_type;
+
+  value_type value;
+  summary_type sum;
+  tag_type tag;
+  bool tagged;
+
+  MonoidNode() : value(), sum(Policy::lift(value)), tag(), tagged(false) {}
+  MonoidNode(const value_type& v) : value(v), sum(Policy::lift(v)), tag(), tagged(false) {}
+
+  void apply(const tag_type& t, size_t n) {
+    Policy::apply(value, t);
+    Policy::apply(sum, t, n);
+    if (tagged) {
+      Policy::compose(tag, t);
+    } else {
+      tag = t; tagged = true;
+    }
+  }
+};
+
+struct MonoidPull {
+  template <class Iter> void operator()(Iter it) const {
+    // Iter is an RBTree iterator or a PersistentRBTree node_ref, which has
+    // no iterator_traits; both dereference to the MonoidNode
+    typedef typename std::decay<decltype(*it)>::type::policy_type Policy;
+    auto sum = Policy::lift(it->value);
+    if (!it.left_child().is_null()) sum = Policy::combine(it.left_child()->sum, sum);
+    if (!it.right_child().is_null()) sum = Policy::combine(sum, it.right_child()->sum);
+    it->sum = sum;
+  }
+};
+
+struct MonoidPush {
+  template <class Iter> void operator()(Iter it) const {
+    if (!it->tagged) return;
+    if (!it.left_child().is_null()) {
+      it.left_child()->apply(it->tag, it.left_child().tree_size());
+    }
+    if (!it.right_child().is_null()) {
+      it.right_child()->apply(it->tag, it.right_child().tree_size());
+    }
+    it->tagged = false;
+  }
+};
+
+template <class Policy, class Alloc = allocator<MonoidNode<Policy>>>
+using MonoidRBTree = RBTree<MonoidNode<Policy>, MonoidPull, MonoidPush, Alloc>;
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef ROBIN_HOOD_UNORDERED_H_
+#define ROBIN_HOOD_UNORDERED_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+// Robin Hood open-addressing counterpart of UnorderedMap with the same
+// interface, meant for high load factors (up to 0.97).
+//
+// Elements sit in one array of slots with linear probing; a 16-bit word per
+// slot holds its probe distance + 1 (0: empty). Inserting never leaves a key
+// behind one that is further from home, so every run is ordered by home slot
+// and a lookup stops at the first slot whose distance is smaller than its
+// own: a miss costs about as much as a hit. Insertion shifts the rest of the
+// run one slot right, erase shifts it back (no tombstones). A distance that
+// would not fit makes the table grow, so more than 65534 keys with one hash
+// value cannot be stored: std::length_error is thrown once growing stops
+// shortening the run.
+
+template <class Key, class T, class Hash = std::hash<Key>, class Pred = std::equal_to<Key>>
+class RobinHoodUnorderedMap {
+public:
+  typedef std::pair<const Key, T> value_type;
+  typedef size_t size_type;
+
+private:
+  static const size_t kMaxDist_ = 65535;
+  static const size_t kAlign_ = alignof(value_type) > alignof(void*) ? alignof(value_type) : alignof(void*);
+
+  template <bool kConst> class Iter_ {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<const Key, T> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename std::conditional<kConst, const value_type, value_type>::type V;
+    typedef V* pointer;
+    typedef V& reference;
+  private:
+    const uint16_t* dist_;
+    V* slot_;
+    Iter_(const uint16_t* d, V* s) : dist_(d), slot_(s) {}
+
+    void Skip() {
+      while (!*dist_) ++dist_, ++slot_;
+    }
+    void Next() {
+      ++dist_, ++slot_;
+      Skip();
+    }
+  public:
+    Iter_() : dist_(nullptr), slot_(nullptr) {}
+    template <bool k, class = typename std::enable_if<kConst && !k>::type>
+    Iter_(const Iter_<k>& a) : dist_(a.dist_), slot_(a.slot_) {}
+
+    const Iter_& operator++() { Next(); return *this; }
+    Iter_ operator++(int) { Iter_ prv(*this); Next(); return prv; }
+    bool operator==(const Iter_& a) const { return dist_ == a.dist_; }
+    bool operator!=(const Iter_& a) const { return dist_ != a.dist_; }
+    V& operator*() const { return *slot_; }
+    V* operator->() const { return slot_; }
+
+    template <bool> friend class Iter_;
+    friend class RobinHoodUnorderedMap;
+  };
+
+public:
+  typedef Iter_<false> iterator;
+  typedef Iter_<true> const_iterator;
+
+private:
+  uint16_t* dist_; // slots, then the end marker; the slot array follows
+  value_type* slots_;
+  size_t mask_; // slots - 1
+  size_t shift_; // 64 - lg slots
+  size_t size_;
+  size_t limit_; // grow before size_ would exceed this
+  Hash hasher_;
+  Pred pred_;
+  float alpha_;
+
+  // Fibonacci hashing: the top bits of the product spread the identity
+  // std::hash of integers over the whole table
+  template <class K> size_t Home_(const K& key) const {
+    return (uint64_t)hasher_(key) * 0x9e3779b97f4a7c15ull >> shift_;
+  }
+
+  // a table without storage: two empty slots, then the end marker
+  static uint16_t* EmptyDist_() {
+    static uint16_t empty[3] = {0, 0, 1};
+    return empty;
+  }
+  bool Owned_() const { return dist_ != EmptyDist_(); }
+
+  size_t Limit_(size_t cap) const {
+    size_t lim = cap * alpha_;
+    return lim < cap ? lim : cap - 1;
+  }
+  size_t CapFor_(size_t n) const {
+    size_t cap = 2;
+    while (Limit_(cap) < n) cap <<= 1;
+    return cap;
+  }
+  static size_t SlotOffset_(size_t cap) {
+    return ((cap + 1) * sizeof(uint16_t) + kAlign_ - 1) / kAlign_ * kAlign_;
+  }
+
+  void Allocate_(size_t cap) {
+    size_t bytes = SlotOffset_(cap) + cap * sizeof(value_type);
+    uint16_t* dist = (uint16_t*)aligned_alloc(kAlign_, (bytes + kAlign_ - 1) / kAlign_ * kAlign_);
+    if (!dist) throw std::bad_alloc();
+    dist_ = dist;
+    slots_ = (value_type*)((char*)dist_ + SlotOffset_(cap));
+    memset(dist_, 0, cap * sizeof(uint16_t));
+    dist_[cap] = 1;
+    mask_ = cap - 1;
+    shift_ = 64 - std::__lg(cap);
+    limit_ = Limit_(cap);
+  }
+  void DestroyAll_() {
+    if (std::is_trivially_destructible<value_type>::value) return;
+    for (size_t i = 0; i <= mask_; i++) {
+      if (dist_[i]) slots_[i].~value_type();
+    }
+  }
+  void Destroy_() {
+    if (!Owned_()) return;
+    DestroyAll_();
+    free(dist_);
+  }
+  void Reset_() {
+    dist_ = EmptyDist_();
+    slots_ = nullptr;
+    mask_ = 1;
+    shift_ = 63;
+    size_ = limit_ = 0;
+  }
+
+  // true and the slot of key in i if present; otherwise false, with i and d
+  // the slot and distance + 1 the key would be inserted at. Runs are ordered
+  // by home, so skip keys from earlier homes, then compare those sharing ours
+  template <class K> bool Locate_(const K& key, size_t& i, size_t& d) const {
+    i = Home_(key);
+    for (d = 1; dist_[i] > d; i = (i + 1) & mask_) d++;
+    for (; dist_[i] == d; i = (i + 1) & mask_, d++) {
+      if (pred_(slots_[i].first, key)) return true;
+    }
+    return false;
+  }
+  // frees slot i for an element at distance d - 1 by shifting the rest of
+  // its run one slot right; false if some distance would overflow
+  bool MakeRoom_(size_t i, size_t d) {
+    if (d > kMaxDist_) return false;
+    size_t e = i;
+    for (; dist_[e]; e = (e + 1) & mask_) {
+      if (dist_[e] == kMaxDist_) return false;
+    }
+    for (size_t p; e != i; e = p) {
+      p = (e - 1) & mask_;
+      new (slots_ + e) value_type(std::move(slots_[p]));
+      slots_[p].~value_type();
+      dist_[e] = dist_[p] + 1;
+    }
+    dist_[i] = d;
+    size_++;
+    return true;
+  }
+  // claims a slot for a key known to be absent, growing while its run is
+  // too long; the caller constructs the element there. Doubling splits runs
+  // by home, so a run that doesn't get shorter is made of keys sharing one
+  // hash and can't be fixed by growing
+  template <class K> size_t Claim_(const K& key) {
+    for (size_t last = -1;;) {
+      size_t i = Home_(key), d = 1;
+      for (; dist_[i] >= d; i = (i + 1) & mask_) d++;
+      if (MakeRoom_(i, d)) return i;
+      size_t worst = d;
+      for (size_t e = i; dist_[e]; e = (e + 1) & mask_) worst = std::max<size_t>(worst, dist_[e] + 1);
+      if (worst >= last) throw std::length_error("RobinHoodUnorderedMap: too many equal hashes");
+      last = worst;
+      Resize_((mask_ + 1) * 2);
+    }
+  }
+  // builds the element in slot i claimed by MakeRoom_ or Claim_; if that
+  // throws, the slot is given back and the run shifted home again
+  template <class... Args> void Fill_(size_t i, Args&&... args) {
+    try {
+      new (slots_ + i) value_type(std::forward<Args>(args)...);
+    } catch (...) {
+      CloseSlot_(i);
+      throw;
+    }
+  }
+  void EraseSlot_(size_t i) {
+    slots_[i].~value_type();
+    CloseSlot_(i);
+  }
+  // empties slot i (already destroyed) by shifting the rest of its run left
+  void CloseSlot_(size_t i) {
+    for (size_t j = (i + 1) & mask_; dist_[j] > 1; i = j, j = (j + 1) & mask_) {
+      new (slots_ + i) value_type(std::move(slots_[j]));
+      slots_[j].~value_type();
+      dist_[i] = dist_[j] - 1;
+    }
+    dist_[i] = 0;
+    size_--;
+  }
+  void Resize_(size_t cap) {
+    uint16_t* odist = dist_;
+    value_type* oslots = slots_;
+    size_t ocap = Owned_() ? mask_ + 1 : 0;
+    Allocate_(cap);
+    size_ = 0;
+    for (size_t j = 0; j < ocap; j++) {
+      if (!odist[j]) continue;
+      new (slots_ + Claim_(oslots[j].first)) value_type(std::move(oslots[j]));
+      oslots[j].~value_type();
+    }
+    if (ocap) free(odist);
+  }
+
+  template <class K, class... Args>
+  std::pair<iterator, bool> Emplace_(const K& key, Args&&... args) {
+    size_t i, d;
+    if (Locate_(key, i, d)) return {MakeIter_(i), false};
+    if (size_ < limit_ && !dist_[i] && d <= kMaxDist_) {
+      MakeRoom_(i, d); // nothing to shift
+      Fill_(i, std::forward<Args>(args)...);
+      return {MakeIter_(i), true};
+    }
+    // args (and key) may refer into the table, which shifting or growing
+    // moves: build first
+    value_type val(std::forward<Args>(args)...);
+    if (size_ >= limit_) {
+      Resize_(CapFor_(size_ + 1));
+      i = Claim_(val.first);
+    } else if (!MakeRoom_(i, d)) {
+      i = Claim_(val.first);
+    }
+    Fill_(i, std::move(val));
+    return {MakeIter_(i), true};
+  }
+
+  iterator MakeIter_(size_t i) const { return iterator(dist_ + i, slots_ + i); }
+  iterator Begin_() const {
+    iterator it(dist_, slots_);
+    it.Skip();
+    return it;
+  }
+  iterator End_() const { return iterator(dist_ + mask_ + 1, nullptr); }
+public:
+  explicit RobinHoodUnorderedMap(size_type bucket = 0, const Hash& hf = Hash(), const Pred& eq = Pred()) :
+      hasher_(hf), pred_(eq), alpha_(0.9) {
+    Reset_();
+    if (bucket) Resize_(CapFor_(bucket));
+  }
+  template <class It> RobinHoodUnorderedMap(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred()) : hasher_(hf), pred_(eq), alpha_(0.9) {
+    Reset_();
+    size_t n = std::max<size_t>(bucket, std::distance(first, last));
+    if (n) Resize_(CapFor_(n));
+    for (; first != last; first++) insert(*first);
+  }
+  RobinHoodUnorderedMap(const RobinHoodUnorderedMap& mp) :
+      hasher_(mp.hasher_), pred_(mp.pred_), alpha_(mp.alpha_) {
+    Reset_();
+    if (!mp.Owned_()) return;
+    Allocate_(mp.mask_ + 1);
+    memcpy(dist_, mp.dist_, (mask_ + 1) * sizeof(uint16_t));
+    for (size_t i = 0; i <= mask_; i++) {
+      if (dist_[i]) new (slots_ + i) value_type(mp.slots_[i]);
+    }
+    size_ = mp.size_;
+  }
+  RobinHoodUnorderedMap(RobinHoodUnorderedMap&& mp) : dist_(mp.dist_), slots_(mp.slots_),
+      mask_(mp.mask_), shift_(mp.shift_), size_(mp.size_), limit_(mp.limit_),
+      hasher_(mp.hasher_), pred_(mp.pred_), alpha_(mp.alpha_) {
+    mp.Reset_();
+  }
+  ~RobinHoodUnorderedMap() { Destroy_(); }
+
+  const RobinHoodUnorderedMap& operator=(const RobinHoodUnorderedMap& mp) {
+    if (this != &mp) {
+      RobinHoodUnorderedMap tmp(mp);
+      swap(tmp);
+    }
+    return *this;
+  }
+  const RobinHoodUnorderedMap& operator=(RobinHoodUnorderedMap&& mp) {
+    if (this != &mp) {
+      Destroy_();
+      Reset_();
+      swap(mp);
+    }
+    return *this;
+  }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() {
+    if (!size_) return;
+    DestroyAll_();
+    memset(dist_, 0, (mask_ + 1) * sizeof(uint16_t));
+    size_ = 0;
+  }
+  void swap(RobinHoodUnorderedMap& mp) {
+    std::swap(dist_, mp.dist_);
+    std::swap(slots_, mp.slots_);
+    std::swap(mask_, mp.mask_);
+    std::swap(shift_, mp.shift_);
+    std::swap(size_, mp.size_);
+    std::swap(limit_, mp.limit_);
+    std::swap(hasher_, mp.hasher_);
+    std::swap(pred_, mp.pred_);
+    std::swap(alpha_, mp.alpha_);
+  }
+
+  iterator begin() { return Begin_(); }
+  iterator end() { return End_(); }
+  const_iterator begin() const { return Begin_(); }
+  const_iterator end() const { return End_(); }
+  const_iterator cbegin() const { return Begin_(); }
+  const_iterator cend() const { return End_(); }
+
+  T& operator[](const Key& val) { return try_emplace(val).first->second; }
+  T& operator[](Key&& val) { return try_emplace(std::move(val)).first->second; }
+
+  const_iterator find(const Key& val) const {
+    size_t i, d;
+    return Locate_(val, i, d) ? MakeIter_(i) : End_();
+  }
+  iterator find(const Key& val) {
+    size_t i, d;
+    return Locate_(val, i, d) ? MakeIter_(i) : End_();
+  }
+
+  std::pair<iterator, bool> insert(const value_type& val) { return Emplace_(val.first, val); }
+  std::pair<iterator, bool> insert(value_type&& val) { return Emplace_(val.first, std::move(val)); }
+  template <class... Args> std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    return Emplace_(key, std::piecewise_construct, std::forward_as_tuple(key),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <class... Args> std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    return Emplace_(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args) {
+    value_type val(std::forward<Args>(args)...);
+    return Emplace_(val.first, std::move(val));
+  }
+  template <class M> std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    auto it = try_emplace(key, std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+  template <class M> std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+    auto it = try_emplace(std::move(key), std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+
+  // shifts later elements of the run back, so an iterator to the erased
+  // element may then point at another one
+  void erase(const_iterator it) { EraseSlot_(it.dist_ - dist_); }
+  size_type erase(const Key& val) {
+    size_t i, d;
+    if (!Locate_(val, i, d)) return 0;
+    EraseSlot_(i);
+    return 1;
+  }
+
+  // slots
+  size_type bucket_count() const { return Owned_() ? mask_ + 1 : 0; }
+  float load_factor() const { return bucket_count() ? (float)size_ / bucket_count() : 0; }
+  float max_load_factor() const { return alpha_; }
+  // clamped to [0.25, 0.97]
+  void max_load_factor(float na) {
+    alpha_ = std::min(std::max(na, 0.25f), 0.97f);
+    if (!Owned_()) return;
+    limit_ = Limit_(mask_ + 1);
+    if (size_ > limit_) Resize_(CapFor_(size_));
+  }
+  void rehash(size_type b) {
+    size_t cap = CapFor_(size_);
+    while (cap < b) cap <<= 1;
+    if (!Owned_() || cap != mask_ + 1) Resize_(cap);
+  }
+  void shrink_to_fit() {
+    if (!size_) {
+      Destroy_();
+      Reset_();
+    } else if (CapFor_(size_) != mask_ + 1) {
+      Resize_(CapFor_(size_));
+    }
+  }
+  void reserve(size_type n) {
+    if (n > limit_) Resize_(CapFor_(n));
+  }
+};
+
+#endif
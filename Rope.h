@@ -0,0 +1,417 @@
+#ifndef ROPE_H_
+#define ROPE_H_
+
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include "RBTree.h"
+
+// Sequence container with the interface of RBTree that stores elements in
+// contiguous chunks of up to kChunk elements. The chunks are kept in an
+// RBTree, so split / merge reuse its join machinery, while scans and rank
+// queries touch one tree node per chunk instead of one per element.
+//
+// PullFunc / PushFunc are called with an RBTree iterator to a chunk. A chunk
+// exposes its elements (size(), operator[], begin(), end()), the number of
+// elements in its subtree (total) and a user-defined Info object (info) to
+// keep aggregates and lazy tags in.
+
+struct RopeNoInfo {};
+
+template <class T, class PullFunc, class PushFunc, class Info, size_t kChunk> class Rope;
+
+template <class T, class Info, size_t kChunk> struct RopeChunk {
+  size_t count, total;
+  Info info;
+
+  RopeChunk() : count(0), total(0), info() {}
+  RopeChunk(const RopeChunk& x) : count(x.count), total(x.total), info(x.info) {
+    std::uninitialized_copy(x.begin(), x.end(), begin());
+  }
+  RopeChunk(RopeChunk&& x) : count(x.count), total(x.total), info(std::move(x.info)) {
+    std::uninitialized_copy(std::make_move_iterator(x.begin()),
+                            std::make_move_iterator(x.end()), begin());
+  }
+  ~RopeChunk() { Destroy_(0); }
+  RopeChunk& operator=(RopeChunk x) {
+    swap(*this, x);
+    return *this;
+  }
+  friend void swap(RopeChunk& a, RopeChunk& b) {
+    RopeChunk& s = a.count < b.count ? a : b;
+    RopeChunk& l = a.count < b.count ? b : a;
+    std::swap_ranges(s.begin(), s.end(), l.begin());
+    s.Steal_(l, s.count);
+    std::swap(a.total, b.total);
+    using std::swap; swap(a.info, b.info);
+  }
+
+  size_t size() const { return count; }
+  T* begin() { return reinterpret_cast<T*>(buf_); }
+  T* end() { return begin() + count; }
+  const T* begin() const { return reinterpret_cast<const T*>(buf_); }
+  const T* end() const { return begin() + count; }
+  T& operator[](size_t x) { return begin()[x]; }
+  const T& operator[](size_t x) const { return begin()[x]; }
+
+  template <class... Args> void Insert_(size_t pos, Args&&... args) {
+    T* dat = begin();
+    if (pos == count) {
+      new(dat + count) T(std::forward<Args>(args)...);
+    } else {
+      new(dat + count) T(std::move(dat[count - 1]));
+      std::move_backward(dat + pos, dat + count - 1, dat + count);
+      dat[pos] = T(std::forward<Args>(args)...);
+    }
+    count++;
+  }
+  void Erase_(size_t pos) {
+    std::move(begin() + pos + 1, end(), begin() + pos);
+    begin()[--count].~T();
+  }
+  // append the elements [pos, count) of x, removing them from x
+  void Steal_(RopeChunk& x, size_t pos) {
+    std::uninitialized_copy(std::make_move_iterator(x.begin() + pos),
+                            std::make_move_iterator(x.end()), end());
+    count += x.count - pos;
+    x.Destroy_(pos);
+  }
+  void Destroy_(size_t pos) {
+    for (T* it = begin() + pos; it != end(); ++it) it->~T();
+    count = pos;
+  }
+ private:
+  alignas(T) unsigned char buf_[sizeof(T) * kChunk];
+};
+
+namespace RopeBase_ {
+
+template <class PullFunc> struct Pull_ : PullFunc {
+  template <class It> void operator()(It it) {
+    it->total = it->count + (it.left_child().is_null() ? 0 : it.left_child()->total) +
+        (it.right_child().is_null() ? 0 : it.right_child()->total);
+    if (!std::is_same<PullFunc, Nop>::value) PullFunc::operator()(it);
+  }
+};
+
+template <class It> inline size_t Total_(It it) {
+  return it.is_null() ? 0 : it->total;
+}
+template <class It> inline It Select_(It it, size_t& x) {
+  while (true) {
+    size_t sz = Total_(it.left_child());
+    if (x < sz) {
+      it = it.left_child();
+    } else if ((x -= sz) < it->count) {
+      return it;
+    } else {
+      x -= it->count;
+      it = it.right_child();
+    }
+  }
+}
+
+// ChunkIter is an RBTree iterator over chunks; V is T or const T
+template <class T, class ChunkIter, class V> class Iterator_ {
+  ChunkIter chunk_;
+  size_t pos_;
+  typedef Iterator_ Self_;
+
+  Iterator_(ChunkIter chunk, size_t pos) : chunk_(chunk), pos_(pos) {}
+
+  bool IsEnd_() const { return chunk_.black_height() == 0; }
+  ChunkIter Head_() const {
+    ChunkIter it = chunk_;
+    if (IsEnd_()) return it;
+    while (!it.is_root()) it = it.parent();
+    return it.parent();
+  }
+  size_t Order_() const {
+    if (IsEnd_()) return Total_(chunk_.left_child());
+    size_t ret = pos_ + Total_(chunk_.left_child());
+    for (ChunkIter it = chunk_; !it.is_root(); it = it.parent()) {
+      ChunkIter p = it.parent();
+      if (p.right_child() == it) ret += Total_(p.left_child()) + p->count;
+    }
+    return ret;
+  }
+  void Seek_(size_t x) {
+    ChunkIter head = Head_();
+    if (x >= Total_(head.left_child())) {
+      chunk_ = head; pos_ = 0;
+    } else {
+      chunk_ = Select_(head.left_child(), x); pos_ = x;
+    }
+  }
+ public:
+  // iterator tags
+  typedef T value_type;
+  typedef V& reference;
+  typedef V* pointer;
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef ptrdiff_t difference_type;
+
+  Iterator_() : chunk_(), pos_(0) {}
+  template <class C, class U> Iterator_(const Iterator_<T, C, U>& it) :
+      chunk_(it.chunk_), pos_(it.pos_) {}
+
+  reference operator*() const { return (*chunk_)[pos_]; }
+  pointer operator->() const { return &(*chunk_)[pos_]; }
+  Self_& operator++() {
+    if (++pos_ == chunk_->count) ++chunk_, pos_ = 0;
+    return *this;
+  }
+  Self_& operator--() {
+    if (pos_) {
+      pos_--;
+    } else {
+      --chunk_;
+      pos_ = chunk_->count - 1;
+    }
+    return *this;
+  }
+  Self_ operator++(int) {
+    Self_ tmp = *this;
+    ++*this;
+    return tmp;
+  }
+  Self_ operator--(int) {
+    Self_ tmp = *this;
+    --*this;
+    return tmp;
+  }
+  Self_& operator+=(difference_type x) {
+    if (!IsEnd_() && (x >= 0 ? pos_ + x < chunk_->count : (size_t)-x <= pos_)) {
+      pos_ += x;
+    } else {
+      Seek_(Order_() + x);
+    }
+    return *this;
+  }
+  Self_& operator-=(difference_type x) { return *this += -x; }
+  Self_ operator+(difference_type x) const { Self_ tmp = *this; return tmp += x; }
+  Self_ operator-(difference_type x) const { Self_ tmp = *this; return tmp += -x; }
+  difference_type operator-(const Self_& it) const {
+    return (difference_type)Order_() - (difference_type)it.Order_();
+  }
+  reference operator[](difference_type x) const { return *(*this + x); }
+  bool operator==(const Self_& it) const { return chunk_ == it.chunk_ && pos_ == it.pos_; }
+  bool operator!=(const Self_& it) const { return !(*this == it); }
+  bool operator<(const Self_& it) const { return *this - it < 0; }
+  bool operator<=(const Self_& it) const { return !(it < *this); }
+  bool operator>(const Self_& it) const { return it < *this; }
+  bool operator>=(const Self_& it) const { return !(*this < it); }
+
+  ChunkIter chunk() const { return chunk_; }
+  size_t offset() const { return pos_; }
+
+  template <class, class, class> friend class Iterator_;
+  template <class, class, class, class, size_t> friend class ::Rope;
+};
+
+} // namespace RopeBase_
+
+template <class T, class PullFunc = Nop, class PushFunc = Nop, class Info = RopeNoInfo,
+          size_t kChunk = (1024 / sizeof(T) > 8 ? 1024 / sizeof(T) : 8)>
+class Rope {
+ public:
+  typedef RopeChunk<T, Info, kChunk> chunk_type;
+  typedef RBTree<chunk_type, RopeBase_::Pull_<PullFunc>, PushFunc> tree_type;
+  typedef typename tree_type::iterator chunk_iterator;
+  typedef typename tree_type::const_iterator const_chunk_iterator;
+
+  typedef T value_type;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef RopeBase_::Iterator_<T, chunk_iterator, T> iterator;
+  typedef RopeBase_::Iterator_<T, const_chunk_iterator, const T> const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+ private:
+  tree_type tree_;
+
+  void PullPath_(chunk_iterator it) {
+    tree_.pull_node(it);
+    tree_.pull_from(it);
+  }
+  // insert an empty chunk before it and return it
+  chunk_iterator NewChunk_(chunk_iterator it) { return tree_.emplace(it); }
+  // move the elements [pos, count) of it into a new chunk right after it
+  chunk_iterator SplitChunk_(chunk_iterator it, size_t pos) {
+    chunk_iterator nxt = NewChunk_(std::next(it));
+    nxt->Steal_(*it, pos);
+    PullPath_(it);
+    PullPath_(nxt);
+    return nxt;
+  }
+  // merge the chunk after it into it when both are small
+  void Coalesce_(chunk_iterator it) {
+    chunk_iterator nxt = std::next(it);
+    if (nxt == tree_.end() || it->count + nxt->count > kChunk / 2) return;
+    tree_.push_to(it);
+    tree_.push_to(nxt);
+    it->Steal_(*nxt, 0);
+    PullPath_(it);
+    tree_.erase(nxt);
+  }
+  chunk_iterator Locate_(size_t& x) {
+    chunk_iterator it = tree_.root();
+    while (true) {
+      tree_.push_node(it);
+      size_t sz = RopeBase_::Total_(it.left_child());
+      if (x < sz) {
+        it = it.left_child();
+      } else if ((x -= sz) < it->count) {
+        return it;
+      } else {
+        x -= it->count;
+        it = it.right_child();
+      }
+    }
+  }
+ public:
+  Rope() {}
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  Rope(Iter first, Iter last) { assign(first, last); }
+
+  iterator begin() { return iterator(tree_.begin(), 0); }
+  const_iterator begin() const { return const_iterator(tree_.begin(), 0); }
+  const_iterator cbegin() const { return begin(); }
+  iterator end() { return iterator(tree_.end(), 0); }
+  const_iterator end() const { return const_iterator(tree_.end(), 0); }
+  const_iterator cend() const { return end(); }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+  // chunk-level access, e.g. to read the aggregate of the whole sequence
+  chunk_iterator root() { return tree_.root(); }
+  const_chunk_iterator root() const { return tree_.root(); }
+  size_type chunk_count() const { return tree_.size(); }
+
+  bool empty() const { return tree_.empty(); }
+  size_type size() const { return empty() ? 0 : tree_.root()->total; }
+
+  reference operator[](size_type x) {
+    chunk_iterator it = RopeBase_::Select_(tree_.root(), x);
+    return (*it)[x];
+  }
+  const_reference operator[](size_type x) const {
+    const_chunk_iterator it = RopeBase_::Select_(tree_.root(), x);
+    return (*it)[x];
+  }
+  reference at(size_type x) {
+    chunk_iterator it = Locate_(x);
+    return (*it)[x];
+  }
+  reference front() { return (*tree_.begin())[0]; }
+  const_reference front() const { return (*tree_.begin())[0]; }
+  reference back() { return tree_.back()[tree_.back().count - 1]; }
+  const_reference back() const { return tree_.back()[tree_.back().count - 1]; }
+  template <class Pred> iterator partition_bound(Pred&& func) {
+    chunk_iterator it = tree_.partition_bound([&](const chunk_type& c) {
+      return func(c[c.count - 1]);
+    });
+    if (it == tree_.end()) return end();
+    return iterator(it, std::partition_point(it->begin(), it->end(), func) - it->begin());
+  }
+
+  template <class Iter, class = typename std::iterator_traits<Iter>::iterator_category>
+  void assign(Iter first, Iter last) {
+    tree_.clear();
+    while (first != last) {
+      chunk_iterator it = NewChunk_(tree_.end());
+      for (; first != last && it->count < kChunk; ++first) it->Insert_(it->count, *first);
+      PullPath_(it);
+    }
+  }
+  template <class... Args> iterator emplace(iterator it, Args&&... args) {
+    chunk_iterator c = it.chunk_;
+    size_t pos = it.pos_;
+    if (c == tree_.end()) {
+      if (empty() || tree_.back().count == kChunk) {
+        c = NewChunk_(c);
+      } else {
+        c = std::prev(c);
+        pos = c->count;
+      }
+    }
+    tree_.push_to(c);
+    if (c->count == kChunk) {
+      chunk_iterator nxt = SplitChunk_(c, kChunk / 2);
+      if (pos >= kChunk / 2) c = nxt, pos -= kChunk / 2;
+    }
+    c->Insert_(pos, std::forward<Args>(args)...);
+    PullPath_(c);
+    return iterator(c, pos);
+  }
+  iterator insert(iterator it, const T& val) { return emplace(it, val); }
+  iterator insert(iterator it, T&& val) { return emplace(it, std::move(val)); }
+  void push_back(const T& val) { emplace(end(), val); }
+  void push_back(T&& val) { emplace(end(), std::move(val)); }
+  void push_front(const T& val) { emplace(begin(), val); }
+  void push_front(T&& val) { emplace(begin(), std::move(val)); }
+  template <class... Args> void emplace_back(Args&&... args) {
+    emplace(end(), std::forward<Args>(args)...);
+  }
+  template <class... Args> void emplace_front(Args&&... args) {
+    emplace(begin(), std::forward<Args>(args)...);
+  }
+  // returns the iterator following the erased element
+  iterator erase(iterator it) {
+    size_t order = it.Order_();
+    chunk_iterator c = it.chunk_;
+    tree_.push_to(c);
+    c->Erase_(it.pos_);
+    if (!c->count) {
+      tree_.erase(c);
+    } else {
+      PullPath_(c);
+      if (c != tree_.begin()) Coalesce_(std::prev(c));
+      else Coalesce_(c);
+    }
+    return begin() + order;
+  }
+  void pop_back() { erase(std::prev(end())); }
+  void pop_front() { erase(begin()); }
+  void clear() { tree_.clear(); }
+
+  void swap(Rope& x) { tree_.swap(x.tree_); }
+  void merge(Rope& x) {
+    if (x.empty()) return;
+    if (empty()) { swap(x); return; }
+    chunk_iterator last = std::prev(tree_.end());
+    tree_.merge(x.tree_);
+    Coalesce_(last);
+  }
+  // elements from it on are moved to x
+  void split(iterator it, Rope& x) {
+    x.clear();
+    chunk_iterator c = it.chunk_;
+    if (c == tree_.end()) return;
+    if (it.pos_) {
+      tree_.push_to(c);
+      c = SplitChunk_(c, it.pos_);
+    }
+    tree_.split(c, x.tree_);
+  }
+
+  // call after modifying an element through a reference
+  void pull_from(iterator it) { PullPath_(it.chunk_); }
+  void push_to(iterator it) { tree_.push_to(it.chunk_); }
+
+  PullFunc& get_pull_object() { return tree_.get_pull_object(); }
+  PushFunc& get_push_object() { return tree_.get_push_object(); }
+  const PullFunc& get_pull_object() const { return tree_.get_pull_object(); }
+  const PushFunc& get_push_object() const { return tree_.get_push_object(); }
+};
+
+template <class T, class U, class V, class I, size_t N>
+void swap(Rope<T, U, V, I, N>& a, Rope<T, U, V, I, N>& b) {
+  a.swap(b);
+}
+
+#endif
@@ -3,26 +3,80 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 #include <iterator>
 #include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "Myalloc.h"
+#ifdef DEBUG
+#include <cstdio>
+#endif
 
+// Classifiers map a hash to one of N buckets. DefaultClassifier keeps the
+// low bits, which is fastest but piles up keys whose low bits are
+// structured (pointers, multiples of 64, timestamps) under the identity
+// std::hash of integers.
 struct DefaultClassifier {
   size_t operator()(size_t a, size_t N) const { return a & (N - 1); }
 };
+// Fibonacci hashing: multiplies by 2^64 / golden ratio and keeps the top
+// lg N bits, so every bit of the hash affects the bucket. N must be a power
+// of two.
+struct FibonacciClassifier {
+  size_t operator()(size_t a, size_t N) const {
+    return (uint64_t)a * 0x9e3779b97f4a7c15ull >> (63 - std::__lg(N)) >> 1;
+  }
+};
+// Lemire's fastrange over the Fibonacci-mixed hash: a * N >> 64 maps onto
+// [0, N) for any N, so tables need not be powers of two.
+struct FastrangeClassifier {
+  static const bool kAnySize = true;
+  size_t operator()(size_t a, size_t N) const {
+    return (unsigned __int128)((uint64_t)a * 0x9e3779b97f4a7c15ull) * N >> 64;
+  }
+};
+// whether Cls takes any bucket count, not only powers of two
+template <class Cls, class = void> struct UnorderedAnySize : std::false_type {};
+template <class Cls> struct UnorderedAnySize<Cls, typename std::enable_if<Cls::kAnySize>::type> :
+    std::true_type {};
 template <class T> struct Self {
-  T operator()(const T& a) const { return a; }
+  const T& operator()(const T& a) const { return a; }
 };
 template<typename T> struct Identity { typedef T type; };
 
-template <class T, class Hash, class Pred, class Cls = DefaultClassifier, class GetKey = Self<T>>
+// full hash kept in every node when kStore is set: rehashing reuses it and
+// chain walks skip nodes whose hash differs before calling the predicate
+template <bool kStore> struct UnorderedNodeHash {
+  void SetHash(size_t) {}
+  bool HashMatches(size_t) const { return true; }
+};
+template <> struct UnorderedNodeHash<true> {
+  size_t hash;
+  void SetHash(size_t h) { hash = h; }
+  bool HashMatches(size_t h) const { return hash == h; }
+};
+// UnorderedMap stores hashes unless keys are cheap to hash and compare
+template <class Key> struct UnorderedStoreHash : std::integral_constant<bool,
+    !std::is_arithmetic<Key>::value && !std::is_pointer<Key>::value && !std::is_enum<Key>::value> {};
+
+template <class T, class Hash, class Pred, class Cls = DefaultClassifier, class GetKey = Self<T>,
+          class Alloc = slab_allocator<T>, bool kStoreHash = false>
 class UnorderedBase {
 public:
-  struct Node {
+  // tag for constructing the value of a node from arbitrary arguments
+  struct InPlace {};
+  struct Node : UnorderedNodeHash<kStoreHash> {
     Node() {}
     Node(const T& val, Node* nxt = nullptr) : val(val), nxt(nxt) {}
-    Node(T&& val, Node* nxt = nullptr) : val(val), nxt(nxt) {}
-    Node(const Node& a) : val(a.val), nxt(a.nxt) {}
-    Node(Node&& a) : val(std::move(a.val)), nxt(a.nxt) {}
+    Node(T&& val, Node* nxt = nullptr) : val(std::move(val)), nxt(nxt) {}
+    template <class... Args> Node(InPlace, Args&&... args) :
+        val(std::forward<Args>(args)...), nxt(nullptr) {}
+    Node(const Node& a) : UnorderedNodeHash<kStoreHash>(a), val(a.val), nxt(a.nxt) {}
+    Node(Node&& a) : UnorderedNodeHash<kStoreHash>(a), val(std::move(a.val)), nxt(a.nxt) {}
     const Node& operator=(const Node& a) { val = a.val, nxt = a.nxt; return *this; }
     const Node& operator=(Node&& a) { val = std::move(a.val), nxt = a.nxt; return *this; }
 
@@ -31,14 +85,22 @@ public:
   };
   class Iter {
     Node **bucket, **end;
+    Node **rest, **rest_end; // buckets still to visit after end
     Node* node;
-    Iter(Node** a, Node** b, Node* c) : bucket(a), end(b), node(c) {}
+    Iter(Node** a, Node** b, Node* c, Node** d = nullptr, Node** e = nullptr) :
+        bucket(a), end(b), rest(d), rest_end(e), node(c) {}
 
     void Next() {
       if (bucket == end) return;
       node = node->nxt;
       if (node) return;
-      while (++bucket != end) {
+      while (true) {
+        if (++bucket == end) {
+          if (rest == rest_end) return;
+          bucket = rest;
+          end = rest_end;
+          rest = rest_end;
+        }
         if (*bucket) {
           node = *bucket;
           return;
@@ -46,7 +108,7 @@ public:
       }
     }
   public:
-    Iter() : bucket(nullptr), end(nullptr), node(nullptr) {}
+    Iter() : bucket(nullptr), end(nullptr), rest(nullptr), rest_end(nullptr), node(nullptr) {}
 
     const Iter& operator++() { Next(); return *this; }
     Iter operator++(int) { Iter prv(*this); Next(); return prv; }
@@ -60,14 +122,22 @@ public:
   };
   class ConstIter {
     Node **bucket, **end;
+    Node **rest, **rest_end; // buckets still to visit after end
     const Node* node;
-    ConstIter(Node** a, Node** b, const Node* c) : bucket(a), end(b), node(c) {}
+    ConstIter(Node** a, Node** b, const Node* c, Node** d = nullptr, Node** e = nullptr) :
+        bucket(a), end(b), rest(d), rest_end(e), node(c) {}
 
     void Next() {
       if (bucket == end) return;
       node = node->nxt;
       if (node) return;
-      while (++bucket != end) {
+      while (true) {
+        if (++bucket == end) {
+          if (rest == rest_end) return;
+          bucket = rest;
+          end = rest_end;
+          rest = rest_end;
+        }
         if (*bucket) {
           node = *bucket;
           return;
@@ -75,8 +145,9 @@ public:
       }
     }
   public:
-    ConstIter() : bucket(nullptr), end(nullptr), node(nullptr) {}
-    ConstIter(const Iter& a) : bucket(a.bucket), end(a.end), node(a.node) {}
+    ConstIter() : bucket(nullptr), end(nullptr), rest(nullptr), rest_end(nullptr), node(nullptr) {}
+    ConstIter(const Iter& a) : bucket(a.bucket), end(a.end), rest(a.rest), rest_end(a.rest_end),
+        node(a.node) {}
 
     const ConstIter& operator++() { Next(); return *this; }
     ConstIter operator++(int) { ConstIter prv(*this); Next(); return prv; }
@@ -88,49 +159,69 @@ public:
     friend class UnorderedBase;
   };
 private:
+  typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Node> NodeAlloc;
+  typedef std::allocator_traits<NodeAlloc> NodeAllocTraits;
+  // allocators with release() (slab_allocator) take back all nodes at once
+  template <class A> static auto HasRelease(A* a) -> decltype(a->release(), std::true_type());
+  static std::false_type HasRelease(...);
+  typedef decltype(HasRelease((NodeAlloc*)nullptr)) Releasable;
+
   Node** buckets_;
   Node** buckets_end_;
+  // previous table during an incremental rehash; its buckets before
+  // old_ + moved_ have been emptied into buckets_
+  Node** old_;
+  Node** old_end_;
+  size_t moved_;
   size_t size_;
   Hash hasher_;
   Pred pred_;
   Cls classifier_;
   GetKey keyget_;
+  NodeAlloc alloc_;
 
-  template<class U> Node** GetBucket(const U& val, Identity<U>) {
-    return buckets_ + classifier_(hasher_(val), buckets_end_ - buckets_);
+  template <class... Args> Node* NewNode(Args&&... args) {
+    Node* nd = NodeAllocTraits::allocate(alloc_, 1);
+    new (nd) Node(std::forward<Args>(args)...);
+    return nd;
+  }
+  void FreeNode(Node* nd) {
+    nd->~Node();
+    NodeAllocTraits::deallocate(alloc_, nd, 1);
   }
-  template<class U> const Node** GetBucket(const U& val, Identity<U>) const {
-    return buckets_ + classifier_(hasher_(val), buckets_end_ - buckets_);
+
+  template<class U> size_t HashOf(const U& val, Identity<U>) const { return hasher_(val); }
+  size_t HashOf(const T& val, Identity<T>) const { return hasher_(keyget_(val)); }
+  Node** BucketOf(size_t h) const { return buckets_ + classifier_(h, buckets_end_ - buckets_); }
+  // bucket of the previous table that may still hold hash h, or nullptr
+  Node** OldBucketOf(size_t h) const {
+    if (!old_) return nullptr;
+    size_t b = classifier_(h, old_end_ - old_);
+    return b < moved_ ? nullptr : old_ + b;
   }
-  template<class U> Node* FindBucket(Node* nd, const U& val, Identity<U>) const {
+  template<class U> Node* FindBucket(Node* nd, const U& val, size_t h, Identity<U>) const {
     for (; nd; nd = nd->nxt) {
-      if (pred_(keyget_(nd->val), val)) return nd;
+      if (nd->HashMatches(h) && pred_(keyget_(nd->val), val)) return nd;
     }
     return nullptr;
   }
-  template<class U> Node** FindValPrev(Node** bucket, const U& val) const {
+  template<class U> Node** FindValPrev(Node** bucket, const U& val, size_t h) const {
     for (Node* nd = *bucket; nd; nd = nd->nxt) {
-      if (pred_(keyget_(nd->val), val)) return bucket;
+      if (nd->HashMatches(h) && pred_(keyget_(nd->val), val)) return bucket;
       bucket = &nd->nxt;
     }
     return nullptr;
   }
 
-  Node** GetBucket(const T& val, Identity<T>) {
-    return buckets_ + classifier_(hasher_(keyget_(val)), buckets_end_ - buckets_);
-  }
-  const Node** GetBucket(const T& val, Identity<T>) const {
-    return buckets_ + classifier_(hasher_(keyget_(val)), buckets_end_ - buckets_);
-  }
-  Node* FindBucket(Node* nd, const T& val, Identity<T>) const {
+  Node* FindBucket(Node* nd, const T& val, size_t h, Identity<T>) const {
     for (; nd; nd = nd->nxt) {
-      if (pred_(keyget_(nd->val), keyget_(val))) return nd;
+      if (nd->HashMatches(h) && pred_(keyget_(nd->val), keyget_(val))) return nd;
     }
     return nullptr;
   }
-  Node** FindValPrev(Node** bucket, const T& val) const {
+  Node** FindValPrev(Node** bucket, const T& val, size_t h) const {
     for (Node* nd = *bucket; nd; nd = nd->nxt) {
-      if (pred_(keyget_(nd->val), keyget_(val))) return bucket;
+      if (nd->HashMatches(h) && pred_(keyget_(nd->val), keyget_(val))) return bucket;
       bucket = &nd->nxt;
     }
     return nullptr;
@@ -140,27 +231,118 @@ private:
     return bucket;
   }
 
-  template <class U> Node** GetBucket(const U& val) { return GetBucket(val, Identity<U>()); }
-  template <class U> const Node** GetBucket(const U& val) const { return GetBucket(val, Identity<U>()); }
-  template <class U> Node* FindBucket(Node* nd, const U& val) const { return FindBucket(nd, val, Identity<U>()); }
+  template <class U> size_t HashOf(const U& val) const { return HashOf(val, Identity<U>()); }
+  template <class U> Node* FindBucket(Node* nd, const U& val, size_t h) const {
+    return FindBucket(nd, val, h, Identity<U>());
+  }
+  size_t NodeHash(const Node* nd, std::true_type) const { return nd->hash; }
+  size_t NodeHash(const Node* nd, std::false_type) const { return HashOf(nd->val); }
+  size_t NodeHash(const Node* nd) const {
+    return NodeHash(nd, std::integral_constant<bool, kStoreHash>());
+  }
 
+public:
+  template <class U> Iter FindHashed(const U& val, size_t h) const {
+    Node** bucket = BucketOf(h);
+    if (Node* nd = FindBucket(*bucket, val, h)) return MakeIter(bucket, nd);
+    if ((bucket = OldBucketOf(h))) {
+      if (Node* nd = FindBucket(*bucket, val, h)) return MakeIter(bucket, nd, true);
+    }
+    return IterEnd();
+  }
+private:
+  Iter Link(size_t h, Node* nd) {
+    Node** bucket = BucketOf(h);
+    nd->SetHash(h);
+    nd->nxt = *bucket;
+    *bucket = nd;
+    size_++;
+    return MakeIter(bucket, nd);
+  }
+
+  void FreeChains(Node** first, Node** last, std::false_type) {
+    for (; first != last; ++first) {
+      for (Node *a = *first, *nxt; a; a = nxt) {
+        nxt = a->nxt;
+        FreeNode(a);
+      }
+    }
+  }
+  void FreeChains(Node** first, Node** last, std::true_type) {
+    if (std::is_trivially_destructible<T>::value) return;
+    for (; first != last; ++first) {
+      for (Node* a = *first; a; a = a->nxt) a->~Node();
+    }
+  }
+  void ReleaseNodes(std::false_type) {}
+  void ReleaseNodes(std::true_type) { alloc_.release(); }
+  // destroys every node of both tables; the bucket arrays are left as they are
+  void DropNodes() {
+    if (buckets_) FreeChains(buckets_, buckets_end_, Releasable());
+    if (old_) FreeChains(old_ + moved_, old_end_, Releasable());
+    ReleaseNodes(Releasable());
+  }
+  void MoveBucket(Node** bucket) {
+    for (Node *a = *bucket, *nxt; a; a = nxt) {
+      Node** nd = BucketOf(NodeHash(a));
+      nxt = a->nxt;
+      a->nxt = *nd;
+      *nd = a;
+    }
+    *bucket = nullptr;
+  }
+  void FreeOld() {
+    free(old_);
+    old_ = old_end_ = nullptr;
+    moved_ = 0;
+  }
   void ClearAndRemove() {
+    DropNodes();
+    FreeOld();
     if (buckets_) {
-      for (Node** it = buckets_; it != buckets_end_; ++it) {
-        for (Node *a = *it, *nxt; a; a = nxt) {
-          nxt = a->nxt;
-          free(a);
-        }
-      }
       free(buckets_);
       buckets_ = buckets_end_ = nullptr;
     }
   }
 
-  Iter MakeIter(Node** a, Node* b) { return (Iter){a, buckets_end_, b}; }
+  // Parallel relinking: thread t files the nodes of its slice of the input
+  // into row t of a threads x threads grid of chains, by which thread owns
+  // their destination bucket range; thread p then links column p. No two
+  // threads ever write the same bucket, so neither phase takes a lock.
+  struct Chain {
+    Node* head;
+    Node** tail;
+  };
+  static const size_t kParallelCutoff = 1 << 15;
+  static unsigned Threads(unsigned threads, size_t n) {
+    if (!threads) threads = std::thread::hardware_concurrency();
+    return std::max<size_t>(1, std::min<size_t>(threads, n / kParallelCutoff));
+  }
+  // runs fn(0), ..., fn(threads - 1) concurrently
+  template <class F> static void ForEachThread(unsigned threads, F fn) {
+    std::vector<std::thread> th;
+    for (unsigned t = 1; t < threads; t++) th.emplace_back(fn, t);
+    fn(0);
+    for (std::thread& a : th) a.join();
+  }
+  // appends nd to the chain of row for its destination bucket; input order
+  // is kept, so runs of equal keys stay adjacent
+  void File(Chain* row, Node* nd, size_t h, unsigned threads) const {
+    size_t b = BucketOf(h) - buckets_;
+    Chain& c = row[b * threads / (buckets_end_ - buckets_)];
+    *c.tail = nd;
+    c.tail = &nd->nxt;
+  }
+
+  // an iterator in the new table continues into the unmoved part of the old one
+  Iter MakeIter(Node** a, Node* b, bool in_old = false) const {
+    if (in_old) return Iter(a, old_end_, b);
+    return Iter(a, buckets_end_, b, old_ ? old_ + moved_ : nullptr, old_end_);
+  }
 public:
   UnorderedBase(size_t bucket = 1, const Hash& hf = Hash(), const Pred& eq = Pred(),
-      const Cls& cs = Cls()) : size_(0), hasher_(hf), pred_(eq), classifier_(cs), keyget_() {
+      const Cls& cs = Cls(), const Alloc& alloc = Alloc()) : old_(nullptr), old_end_(nullptr),
+      moved_(0), size_(0), hasher_(hf), pred_(eq), classifier_(cs), keyget_(), alloc_(alloc) {
     if (bucket) {
       buckets_ = (Node**)calloc(sizeof(Node*), bucket);
       buckets_end_ = buckets_ + bucket;
@@ -169,194 +351,243 @@ public:
     }
   }
   ~UnorderedBase() {
-    if (!buckets_) return;
-    for (Node** it = buckets_; it != buckets_end_; ++it) {
-      for (Node *a = *it, *nxt; a; a = nxt) {
-        nxt = a->nxt;
-        free(a);
-      }
-    }
-    free(buckets_);
+    ClearAndRemove();
   }
-  UnorderedBase(const UnorderedBase& mp) : size_(mp.size_), hasher_(mp.hasher_),
-      pred_(mp.pred_), classifier_(mp.classifier_), keyget_() {
+  // chains are copied in order; nodes still in the old table of a pending
+  // incremental rehash are inserted into the copy's only table
+  UnorderedBase(const UnorderedBase& mp) : buckets_(nullptr), buckets_end_(nullptr),
+      old_(nullptr), old_end_(nullptr), moved_(0), size_(0), hasher_(mp.hasher_),
+      pred_(mp.pred_), classifier_(mp.classifier_), keyget_(),
+      alloc_(NodeAllocTraits::select_on_container_copy_construction(mp.alloc_)) {
+    if (!mp.buckets_) return;
     buckets_ = (Node**)calloc(sizeof(Node*), mp.buckets_end_ - mp.buckets_);
     buckets_end_ = buckets_ + (mp.buckets_end_ - mp.buckets_);
     for (Node **it = buckets_, **org = mp.buckets_; it != buckets_end_; ++it, ++org) {
       Node** prv = it;
       for (Node *a = *org; a; a = a->nxt) {
-        *prv = (Node*)malloc(sizeof(Node));
-        prv = &a->nxt;
+        *prv = NewNode(*a);
+        (*prv)->nxt = nullptr;
+        prv = &(*prv)->nxt;
+      }
+    }
+    size_ = mp.size_;
+    if (!mp.old_) return;
+    for (Node** it = mp.old_ + mp.moved_; it != mp.old_end_; ++it) {
+      for (Node* a = *it; a; a = a->nxt) {
+        Node** bucket = BucketOf(mp.NodeHash(a));
+        Node* nd = NewNode(*a);
+        nd->nxt = *bucket;
+        *bucket = nd;
       }
     }
   }
   UnorderedBase(UnorderedBase&& mp) : buckets_(mp.buckets_), buckets_end_(mp.buckets_end_),
-      size_(mp.size_), hasher_(mp.hasher_), pred_(mp.pred_), classifier_(mp.classifier_), keyget_() {
+      old_(mp.old_), old_end_(mp.old_end_), moved_(mp.moved_), size_(mp.size_),
+      hasher_(mp.hasher_), pred_(mp.pred_), classifier_(mp.classifier_), keyget_(),
+      alloc_(std::move(mp.alloc_)) {
     mp.buckets_ = nullptr;
+    mp.old_ = nullptr;
   }
 
   const UnorderedBase& operator=(const UnorderedBase& mp) {
-    if (buckets_ == mp.buckets_) return *this;
-    if (buckets_) {
-      for (Node** it = buckets_; it != buckets_end_; ++it) {
-        for (Node *a = *it, *nxt; a; a = nxt) {
-          nxt = a->nxt;
-          free(a);
-        }
-      }
-      if (buckets_end_ - buckets_ != mp.buckets_end_ - mp.buckets_) {
-        free(buckets_);
-        buckets_ = (Node**)calloc(sizeof(Node*), mp.buckets_end_ - mp.buckets_);
-        buckets_end_ = buckets_ + (mp.buckets_end_ - mp.buckets_);
-      } else {
-        std::fill(buckets_, buckets_end_, nullptr);
-      }
-    } else {
-      buckets_ = (Node**)calloc(sizeof(Node*), mp.buckets_end_ - mp.buckets_);
-      buckets_end_ = buckets_ + (mp.buckets_end_ - mp.buckets_);
-    }
-    for (Node **it = buckets_, **org = mp.buckets_; it != buckets_end_; ++it, ++org) {
-      Node** prv = it;
-      for (Node *a = *org; a; a = a->nxt) {
-        *prv = (Node*)malloc(sizeof(Node));
-        prv = &a->nxt;
-      }
-    }
-    size_ = mp.size_;
-    hasher_ = mp.hasher_;
-    pred_ = mp.pred_;
-    classifier_ = mp.classifier_;
+    if (this == &mp) return *this;
+    UnorderedBase tmp(mp);
+    swap(tmp);
     return *this;
   }
   const UnorderedBase& operator=(UnorderedBase&& mp) {
-    if (buckets_ == mp.buckets_) return *this;
+    if (this == &mp) return *this;
+    ClearAndRemove();
     buckets_ = mp.buckets_;
     buckets_end_ = mp.buckets_end_;
+    old_ = mp.old_;
+    old_end_ = mp.old_end_;
+    moved_ = mp.moved_;
     size_ = mp.size_;
     hasher_ = mp.hasher_;
     pred_ = mp.pred_;
     classifier_ = mp.classifier_;
+    alloc_ = std::move(mp.alloc_);
     mp.buckets_ = nullptr;
+    mp.old_ = nullptr;
     return *this;
   }
 
   void clear() {
-    if (buckets_) {
-      for (Node** it = buckets_; it != buckets_end_; ++it) {
-        for (Node *a = *it, *nxt; a; a = nxt) {
-          nxt = a->nxt;
-          free(a);
-        }
-      }
-      std::fill(buckets_, buckets_end_, nullptr);
-      size_ = 0;
-    }
+    DropNodes();
+    FreeOld();
+    if (buckets_) std::fill(buckets_, buckets_end_, nullptr);
+    size_ = 0;
   }
 
   size_t BucketCount() const { return buckets_end_ - buckets_; }
   size_t size() const { return size_; }
+  // ret[k] = number of buckets holding k nodes, old table included
+  std::vector<size_t> ChainHistogram() const {
+    std::vector<size_t> ret(1);
+    auto count = [&](Node* const* first, Node* const* last) {
+      for (; first != last; ++first) {
+        size_t len = 0;
+        for (Node* nd = *first; nd; nd = nd->nxt) len++;
+        if (len >= ret.size()) ret.resize(len + 1);
+        ret[len]++;
+      }
+    };
+    count(buckets_, buckets_end_);
+    if (old_) count(old_ + moved_, old_end_);
+    return ret;
+  }
   void swap(UnorderedBase& mp) {
     std::swap(buckets_, mp.buckets_);
     std::swap(buckets_end_, mp.buckets_end_);
+    std::swap(old_, mp.old_);
+    std::swap(old_end_, mp.old_end_);
+    std::swap(moved_, mp.moved_);
     std::swap(size_, mp.size_);
     std::swap(hasher_, mp.hasher_);
     std::swap(pred_, mp.pred_);
     std::swap(classifier_, mp.classifier_);
+    std::swap(alloc_, mp.alloc_);
   }
 
   Iter Insert(const T& val) {
-    size_++;
-    Node** nd = GetBucket(val);
-    Node* tmp = (Node*)malloc(sizeof(Node));
-    new (tmp) Node(val, *nd);
-    *nd = tmp;
-    return MakeIter(nd, *nd);
+    return Link(HashOf(val), NewNode(val));
   }
   Iter Insert(T&& val) {
-    size_++;
-    Node** nd = GetBucket(val);
-    Node* tmp = (Node*)malloc(sizeof(Node));
-    new (tmp) Node(std::move(val), *nd);
-    *nd = tmp;
-    return MakeIter(nd, *nd);
+    size_t h = HashOf(val);
+    return Link(h, NewNode(std::move(val)));
   }
-  std::pair<Iter, bool> InsertIf(const T& val) {
-    Iter it;
-    it.bucket = GetBucket(val);
-    it.end = buckets_end_;
-    if ((it.node = FindBucket(*(it.bucket), val))) {
-      return {it, false};
-    } else {
-      size_++;
-      it.node = (Node*)malloc(sizeof(Node));
-      new (it.node) Node(val, *(it.bucket));
-      *it.bucket = it.node;
-      return {it, true};
+  // calls fn(i, hash of keys[i]) for every i in order. Lookups run as a
+  // pipeline: the bucket of key i + 2 * kPrefetch and the first node of key
+  // i + kPrefetch are prefetched while key i is handled, so the cache misses
+  // of neighbouring keys overlap instead of being paid one after another
+  template <class U, class F> void ForEachPrefetched(const U* keys, size_t n, F fn) const {
+    static const size_t kPrefetch = 8, kRing = 4 * kPrefetch;
+    size_t h[kRing];
+    for (size_t i = 0; i < n + 2 * kPrefetch; i++) {
+      if (i < n) {
+        h[i % kRing] = HashOf(keys[i]);
+        __builtin_prefetch(BucketOf(h[i % kRing]));
+      }
+      if (i >= kPrefetch && i - kPrefetch < n) {
+        if (Node* nd = *BucketOf(h[(i - kPrefetch) % kRing])) __builtin_prefetch(nd);
+      }
+      if (i >= 2 * kPrefetch) fn(i - 2 * kPrefetch, h[(i - 2 * kPrefetch) % kRing]);
     }
   }
+
+  std::pair<Iter, bool> InsertIfHashed(const T& val, size_t h) {
+    Iter it = FindHashed(val, h);
+    if (it.node) return {it, false};
+    return {Link(h, NewNode(val)), true};
+  }
+  std::pair<Iter, bool> InsertIf(const T& val) {
+    size_t h = HashOf(val);
+    Iter it = FindHashed(val, h);
+    if (it.node) return {it, false};
+    return {Link(h, NewNode(val)), true};
+  }
   std::pair<Iter, bool> InsertIf(T&& val) {
-    Iter it;
-    it.bucket = GetBucket(val);
-    it.end = buckets_end_;
-    if ((it.node = FindBucket(*(it.bucket), val))) {
-      return {it, false};
-    } else {
-      size_++;
-      it.node = (Node*)malloc(sizeof(Node));
-      new (it.node) Node(std::move(val), *(it.bucket));
-      *it.bucket = it.node;
-      return {it, true};
+    size_t h = HashOf(val);
+    Iter it = FindHashed(val, h);
+    if (it.node) return {it, false};
+    return {Link(h, NewNode(std::move(val))), true};
+  }
+  // looks key up and builds the value from args only if it is absent
+  template <class U, class... Args> std::pair<Iter, bool> EmplaceIf(const U& key, Args&&... args) {
+    size_t h = HashOf(key);
+    Iter it = FindHashed(key, h);
+    if (it.node) return {it, false};
+    return {Link(h, NewNode(InPlace(), std::forward<Args>(args)...)), true};
+  }
+  // builds the value first, for when the key is only known afterwards;
+  // the node is dropped again if its key is present
+  template <class... Args> std::pair<Iter, bool> EmplaceNode(Args&&... args) {
+    Node* nd = NewNode(InPlace(), std::forward<Args>(args)...);
+    size_t h = HashOf(nd->val);
+    Iter it = FindHashed(nd->val, h);
+    if (!it.node) return {Link(h, nd), true};
+    FreeNode(nd);
+    return {it, false};
+  }
+  // links the node right after the first one with an equal key, so equal
+  // keys stay adjacent in their chain
+  template <class... Args> Iter EmplaceMulti(Args&&... args) {
+    Node* nd = NewNode(InPlace(), std::forward<Args>(args)...);
+    size_t h = HashOf(nd->val);
+    Iter it = FindHashed(nd->val, h);
+    if (!it.node) return Link(h, nd);
+    nd->SetHash(h);
+    nd->nxt = it.node->nxt;
+    it.node->nxt = nd;
+    size_++;
+    it.node = nd;
+    return it;
+  }
+  // first node with key val and the length of its run
+  template <class U> std::pair<Iter, size_t> FindRun(const U& val) const {
+    size_t h = HashOf(val);
+    Iter it = FindHashed(val, h);
+    size_t n = 0;
+    for (Node* nd = it.node; nd && nd->HashMatches(h) && pred_(keyget_(nd->val), val);
+         nd = nd->nxt) {
+      n++;
     }
+    return {it, n};
+  }
+  // unlinks the whole run of key val; returns its length
+  template <class U> size_t EraseRun(const U& val) {
+    size_t h = HashOf(val);
+    Node** prv = FindValPrev(BucketOf(h), val, h);
+    if (!prv) {
+      Node** bucket = OldBucketOf(h);
+      if (!bucket || !(prv = FindValPrev(bucket, val, h))) return 0;
+    }
+    size_t n = 0;
+    for (Node* nd = *prv; nd && nd->HashMatches(h) && pred_(keyget_(nd->val), val); nd = *prv) {
+      *prv = nd->nxt;
+      FreeNode(nd);
+      n++;
+    }
+    size_ -= n;
+    return n;
   }
 
   template <class U> Iter Find(const U& val) {
-    Iter it;
-    it.bucket = GetBucket(val);
-    it.node = FindBucket(*(it.bucket), val);
-    it.end = buckets_end_;
-    if (it.node) return it;
-    else return IterEnd();
+    return FindHashed(val, HashOf(val));
   }
   template <class U> ConstIter Find(const U& val) const {
-    ConstIter it;
-    it.bucket = GetBucket(val);
-    it.node = FindBucket(*(it.bucket), val);
-    it.end = buckets_end_;
-    if (it.node) return it;
-    else return ConstIterEnd();
+    return FindHashed(val, HashOf(val));
   }
 
   void Erase(ConstIter it) {
     Node** prv = FindNodePrev(it.bucket, it.node);
     Node* tmp = *prv;
     *prv = it.node->nxt;
-    free(tmp);
+    FreeNode(tmp);
     size_--;
   }
   template <class U> bool Erase(const U& val) {
-    Node** bucket = GetBucket(val);
-    Node** prv = FindValPrev(bucket, val);
-    if (!prv) return false;
+    size_t h = HashOf(val);
+    Node** prv = FindValPrev(BucketOf(h), val, h);
+    if (!prv) {
+      Node** bucket = OldBucketOf(h);
+      if (!bucket || !(prv = FindValPrev(bucket, val, h))) return false;
+    }
     Node* tmp = *prv;
     *prv = tmp->nxt;
-    free(tmp);
+    FreeNode(tmp);
     size_--;
     return true;
   }
 
   void Rehash(size_t sz) {
+    RehashFinish();
     if (buckets_ && sz) {
       Node **oldbucket = buckets_, **oldend = buckets_end_;
       buckets_ = (Node**)calloc(sizeof(Node*), sz);
       buckets_end_ = buckets_ + sz;
-      for (Node** it = oldbucket; it != oldend; ++it) {
-        for (Node *a = *it, *nxt; a; a = nxt) {
-          Node** nd = GetBucket(a->val);
-          nxt = a->nxt;
-          a->nxt = *nd;
-          *nd = a;
-        }
-      }
+      for (Node** it = oldbucket; it != oldend; ++it) MoveBucket(it);
       free(oldbucket);
     } else if (sz) {
       buckets_ = (Node**)calloc(sizeof(Node*), sz);
@@ -365,92 +596,250 @@ public:
       ClearAndRemove();
     }
   }
+  // Rehash with the nodes spread over up to `threads` threads (0 means
+  // hardware concurrency); Hash and Cls are called concurrently
+  void RehashParallel(size_t sz, unsigned threads) {
+    RehashFinish();
+    threads = Threads(threads, size_);
+    if (threads < 2 || !buckets_ || !sz) return Rehash(sz);
+    Node **oldbucket = buckets_;
+    size_t old = buckets_end_ - buckets_;
+    buckets_ = (Node**)calloc(sizeof(Node*), sz);
+    buckets_end_ = buckets_ + sz;
+    // the destination bucket is kept next to each node, so without a stored
+    // hash a key is still hashed only once
+    struct Filed {
+      Node* nd;
+      Node** bucket;
+    };
+    std::vector<std::vector<Filed>> grid(threads * threads);
+    ForEachThread(threads, [&](unsigned t) {
+      std::vector<Filed>* row = &grid[t * threads];
+      Node **it = oldbucket + old * t / threads, **end = oldbucket + old * (t + 1) / threads;
+      for (; it != end; ++it) {
+        for (Node* a = *it; a; a = a->nxt) {
+          Node** bucket = BucketOf(NodeHash(a));
+          row[(bucket - buckets_) * threads / sz].push_back({a, bucket});
+        }
+      }
+    });
+    ForEachThread(threads, [&](unsigned p) {
+      for (unsigned t = 0; t < threads; t++) {
+        for (const Filed& f : grid[t * threads + p]) {
+          f.nd->nxt = *f.bucket;
+          *f.bucket = f.nd;
+        }
+      }
+    });
+    free(oldbucket);
+  }
+  // Inserts first[0, n) as InsertIf would one by one, so the first of equal
+  // keys wins, with the work spread over up to `threads` threads. Nodes are
+  // built, hashed and filed per input slice, then linked per bucket range;
+  // the allocator is only touched under a lock, in batches. The table
+  // should already be sized for the result. T's constructor, Hash, Pred and
+  // Cls are called concurrently and must not throw. Returns the number of
+  // nodes inserted.
+  template <class It> size_t InsertParallel(It first, size_t n, unsigned threads) {
+    RehashFinish();
+    threads = Threads(threads, n);
+    if (threads < 2 || !buckets_) {
+      size_t ret = 0;
+      for (size_t i = 0; i < n; i++) ret += EmplaceNode(first[i]).second;
+      return ret;
+    }
+    static const size_t kBatch = 256;
+    std::mutex lock;
+    std::vector<Chain> grid(threads * threads);
+    ForEachThread(threads, [&](unsigned t) {
+      Chain* row = &grid[t * threads];
+      for (unsigned p = 0; p < threads; p++) row[p].tail = &row[p].head;
+      Node* pool[kBatch];
+      size_t left = 0;
+      for (size_t i = n * t / threads, end = n * (t + 1) / threads; i != end; i++) {
+        if (!left) {
+          left = std::min(kBatch, end - i);
+          std::lock_guard<std::mutex> guard(lock);
+          for (size_t k = 0; k < left; k++) pool[k] = NodeAllocTraits::allocate(alloc_, 1);
+        }
+        Node* nd = pool[--left];
+        new (nd) Node(InPlace(), first[i]);
+        size_t h = HashOf(nd->val);
+        nd->SetHash(h);
+        File(row, nd, h, threads);
+      }
+      for (unsigned p = 0; p < threads; p++) *row[p].tail = nullptr;
+    });
+    // nodes whose key was present, per column
+    std::vector<Node*> dup(threads);
+    std::vector<size_t> added(threads);
+    ForEachThread(threads, [&](unsigned p) {
+      Node* drop = nullptr;
+      size_t cnt = 0;
+      for (unsigned t = 0; t < threads; t++) {
+        for (Node *a = grid[t * threads + p].head, *nxt; a; a = nxt) {
+          size_t h = NodeHash(a);
+          Node** bucket = BucketOf(h);
+          nxt = a->nxt;
+          if (FindBucket(*bucket, a->val, h)) {
+            a->nxt = drop;
+            drop = a;
+          } else {
+            a->nxt = *bucket;
+            *bucket = a;
+            cnt++;
+          }
+        }
+      }
+      dup[p] = drop;
+      added[p] = cnt;
+    });
+    size_t ret = 0;
+    for (unsigned p = 0; p < threads; p++) {
+      for (Node *a = dup[p], *nxt; a; a = nxt) {
+        nxt = a->nxt;
+        FreeNode(a);
+      }
+      ret += added[p];
+    }
+    size_ += ret;
+    return ret;
+  }
+  // Switches to a table of sz buckets but keeps the current one alive;
+  // nodes move over as RehashStep is called. Lookups, erasure and
+  // iteration cover both tables meanwhile, and new nodes go to the new one.
+  void RehashIncremental(size_t sz) {
+    RehashFinish();
+    if (!buckets_ || !sz) return Rehash(sz);
+    old_ = buckets_;
+    old_end_ = buckets_end_;
+    moved_ = 0;
+    buckets_ = (Node**)calloc(sizeof(Node*), sz);
+    buckets_end_ = buckets_ + sz;
+  }
+  // moves at most n buckets of the old table; true when nothing is left
+  bool RehashStep(size_t n) {
+    if (!old_) return true;
+    size_t lim = std::min<size_t>(moved_ + n, old_end_ - old_);
+    for (; moved_ < lim; moved_++) MoveBucket(old_ + moved_);
+    if (old_ + moved_ != old_end_) return false;
+    free(old_);
+    old_ = old_end_ = nullptr;
+    moved_ = 0;
+    return true;
+  }
+  void RehashFinish() {
+    if (old_) RehashStep(old_end_ - old_);
+  }
+  bool Rehashing() const { return old_ != nullptr; }
 
   Iter IterBegin() const {
     if (!size_) return IterEnd();
-    Iter it;
-    it.bucket = buckets_;
-    it.end = buckets_end_;
-    while (!*it.bucket) it.bucket++;
-    it.node = *it.bucket;
-    return it;
+    for (Node** it = buckets_; it != buckets_end_; ++it) {
+      if (*it) return MakeIter(it, *it);
+    }
+    Node** it = old_ + moved_;
+    while (!*it) it++;
+    return MakeIter(it, *it, true);
   }
   ConstIter ConstIterBegin() const {
     return IterBegin();
   }
   Iter IterEnd() const {
-    return {buckets_end_, buckets_end_, nullptr};
+    return Iter(buckets_end_, buckets_end_, nullptr);
   }
   ConstIter ConstIterEnd() const {
     return IterEnd();
   }
 };
 
-template <class Key, class T, class Hash = std::hash<Key>,
-          class Pred = std::equal_to<Key>, class Cls = DefaultClassifier>
-class UnorderedMap {
+namespace UnorderedMapBase_ {
+
+template <class Key, class T> struct First_ {
+  const Key& operator()(const std::pair<const Key, T>& a) const { return a.first; }
+};
+
+// Sizing, rehash policy, iteration and lookup shared by the front-ends.
+// Value is the stored type and KeyOf extracts its key; sets pass
+// kConst = true to expose only const iterators
+template <class Key, class Value, class KeyOf, class Hash, class Pred, class Cls, class Alloc,
+          bool kStoreHash, bool kConst>
+class Table_ {
 public:
-  typedef std::pair<const Key, T> value_type;
+  typedef Key key_type;
+  typedef Value value_type;
   typedef size_t size_type;
+  typedef Alloc allocator_type;
 
-private:
-  struct GetFirst {
-    Key operator()(const value_type& val) const { return val.first; }
-  };
-  typedef UnorderedBase<value_type, Hash, Pred, Cls, GetFirst> base_type;
+protected:
+  typedef UnorderedBase<Value, Hash, Pred, Cls, KeyOf, Alloc, kStoreHash> base_type;
+
+  // buckets moved per insertion while an incremental rehash is running
+  static const size_t kRehashStep_ = 4;
 
   base_type base_;
   float alpha_;
+  bool incremental_;
 
+  // bucket count for a request of b: b itself if the classifier takes any
+  // size, the next power of two otherwise
+  static size_t BucketsFor(size_t b) {
+    if (UnorderedAnySize<Cls>::value) return b ? b : 1;
+    return 2l << std::__lg(b - 1);
+  }
   void CheckRehash() {
+    if (incremental_ && !base_.RehashStep(kRehashStep_)) return;
     if ((float)base_.size() / base_.BucketCount() > alpha_) {
-      base_.Rehash(base_.BucketCount() * 2);
+      if (incremental_) {
+        base_.RehashIncremental(base_.BucketCount() * 2);
+      } else {
+        base_.Rehash(base_.BucketCount() * 2);
+      }
     }
   }
-public:
-  typedef typename base_type::Iter iterator;
-  typedef typename base_type::ConstIter const_iterator;
-
-  explicit UnorderedMap(size_type bucket = 4, const Hash& hf = Hash(), const Pred& eq = Pred(),
-      const Cls& cs = Cls()) : base_(2l << std::__lg(bucket - 1), hf, eq, cs), alpha_(1.0) {}
-  template <class It> UnorderedMap(It first, It last, size_type bucket = 0,
-      const Hash& hf = Hash(), const Pred& eq = Pred(), const Cls& cs = Cls()) :
-      base_(2l << std::__lg(std::max(4, std::distance(first, last)) - 1), hf, eq, cs), alpha_(1.0) {
-    for (; first != last; first++) base_.InsertIf(*first);
+  template <class It> void FindBatch(const Key* keys, size_t n, It* out) const {
+    base_.ForEachPrefetched(keys, n, [&](size_t i, size_t h) {
+      out[i] = base_.FindHashed(keys[i], h);
+    });
   }
-  UnorderedMap(const UnorderedMap& mp) : base_(mp.base_), alpha_(mp.alpha_) {}
-  UnorderedMap(UnorderedMap&& mp) : base_(std::move(mp.base_)), alpha_(mp.alpha_) {}
-
-  const UnorderedMap& operator=(const UnorderedMap& mp) {
-    base_ = mp.base_;
-    alpha_ = mp.alpha_;
+  template <class It> size_type InsertParallel(It first, It last, unsigned threads) {
+    size_type n = last - first;
+    if ((base_.size() + n) / alpha_ > base_.BucketCount()) {
+      rehash((base_.size() + n) / alpha_, threads);
+    }
+    return base_.InsertParallel(first, n, threads);
   }
-  const UnorderedMap& operator=(UnorderedMap&& mp) {
-    base_ = std::move(mp.base_);
-    alpha_ = mp.alpha_;
+  // equal keys are adjacent, so the range is one walk along a chain
+  template <class It> std::pair<It, It> EqualRange(const Key& key) const {
+    auto run = base_.FindRun(key);
+    It first = run.first, last = first;
+    for (size_t i = 0; i < run.second; i++) ++last;
+    return {first, last};
   }
+public:
+  typedef typename std::conditional<kConst, typename base_type::ConstIter,
+                                    typename base_type::Iter>::type iterator;
+  typedef typename base_type::ConstIter const_iterator;
+
+  explicit Table_(size_type bucket = 4, const Hash& hf = Hash(), const Pred& eq = Pred(),
+      const Cls& cs = Cls(), const Alloc& alloc = Alloc()) :
+      base_(BucketsFor(bucket), hf, eq, cs, alloc), alpha_(1.0),
+      incremental_(false) {}
 
   size_type size() const { return base_.size(); }
   bool empty() const { return base_.size() == 0; }
   void clear() { base_.clear(); }
-  void swap(UnorderedMap& mp) { base_.swap(mp.base_); std::swap(alpha_, mp.alpha_); }
+  void swap(Table_& mp) {
+    base_.swap(mp.base_);
+    std::swap(alpha_, mp.alpha_);
+    std::swap(incremental_, mp.incremental_);
+  }
 
   iterator begin() const { return base_.IterBegin(); }
   iterator end() const { return base_.IterEnd(); }
   const_iterator cbegin() const { return base_.ConstIterBegin(); }
   const_iterator cend() const { return base_.ConstIterEnd(); }
 
-  T& operator[](const Key& val) {
-    CheckRehash();
-    auto it = base_.InsertIf(std::make_pair(val, T()));
-    return it.first->second;
-  }
-  T& operator[](Key&& val) {
-    CheckRehash();
-    auto it = base_.InsertIf(std::make_pair(std::move(val), T()));
-    return it.first->second;
-  }
-
   const_iterator find(const Key& val) const {
     return base_.Find(val);
   }
@@ -458,19 +847,14 @@ public:
     return base_.Find(val);
   }
 
-  std::pair<iterator, bool> insert(const value_type& val) {
-    CheckRehash();
-    auto it = base_.InsertIf(val);
-    return std::make_pair(iterator(it.first), it.second);
-  }
-  std::pair<iterator, bool> insert(value_type&& val) {
-    CheckRehash();
-    auto it = base_.InsertIf(std::move(val));
-    return std::make_pair(iterator(it.first), it.second);
+  // out[i] = find(keys[i]); buckets and chain heads are prefetched a few
+  // keys ahead, so the cache misses of consecutive keys overlap
+  void find_batch(const Key* keys, size_type n, iterator* out) { FindBatch(keys, n, out); }
+  void find_batch(const Key* keys, size_type n, const_iterator* out) const {
+    FindBatch(keys, n, out);
   }
 
   void erase(const_iterator it) { base_.Erase(it); }
-  size_type erase(const Key& val) { return base_.Erase(val); }
 
   size_type bucket_count() const { return base_.BucketCount(); }
   float load_factor() const { return (float)base_.size() / base_.BucketCount(); }
@@ -479,18 +863,277 @@ public:
     alpha_ = na;
     CheckRehash();
   }
-  void rehash(size_type b) {
-    b = 2l << std::__lg(b - 1);
-    if (b > base_.BucketCount() || (float)base_.size() / b <= alpha_) base_.Rehash(b);
+  // with threads other than 1, nodes are relinked by that many threads
+  // (0 means hardware concurrency) once the table is large enough
+  void rehash(size_type b, unsigned threads = 1) {
+    b = BucketsFor(b);
+    if (b > base_.BucketCount() || (float)base_.size() / b <= alpha_) {
+      base_.RehashParallel(b, threads);
+    }
   }
   void shrink_to_fit() {
-    size_type b = base_.size() / alpha_;
-    b = 2l << std::__lg(b - 1);
+    size_type b = BucketsFor(base_.size() / alpha_);
     if (b != base_.BucketCount()) base_.Rehash(b);
   }
   void reserve(size_type b) {
     rehash(b / alpha_);
   }
+
+  // Chain-length histogram: ret[k] is the number of buckets with k nodes.
+  // Long tails mean the classifier clusters the keys' hashes; try
+  // FibonacciClassifier or FastrangeClassifier.
+  std::vector<size_type> chain_histogram() const { return base_.ChainHistogram(); }
+#ifdef DEBUG
+  void print_chains_() const {
+    std::vector<size_type> hist = chain_histogram();
+    printf("%zu nodes in %zu buckets, load %.2f\n", size(), bucket_count(), load_factor());
+    for (size_type k = 0; k < hist.size(); k++) {
+      if (hist[k]) printf("  %3zu: %zu\n", k, hist[k]);
+    }
+  }
+#endif
+
+  // When on, growing keeps the old bucket array and moves a few buckets per
+  // insertion instead of relinking every node at once, which bounds the
+  // latency of any single insert. Lookups check both arrays meanwhile.
+  // Insertions may still invalidate iterators, as with a regular rehash;
+  // find and erase never move nodes. Turning it off finishes a pending
+  // rehash.
+  bool incremental_rehash() const { return incremental_; }
+  void incremental_rehash(bool on) {
+    incremental_ = on;
+    if (!on) base_.RehashFinish();
+  }
+};
+
+} // namespace UnorderedMapBase_
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>, class Cls = DefaultClassifier,
+          class Alloc = slab_allocator<std::pair<const Key, T>>,
+          bool kStoreHash = UnorderedStoreHash<Key>::value>
+class UnorderedMap : public UnorderedMapBase_::Table_<Key, std::pair<const Key, T>,
+    UnorderedMapBase_::First_<Key, T>, Hash, Pred, Cls, Alloc, kStoreHash, false> {
+  typedef UnorderedMapBase_::Table_<Key, std::pair<const Key, T>,
+      UnorderedMapBase_::First_<Key, T>, Hash, Pred, Cls, Alloc, kStoreHash, false> Base_;
+  using Base_::base_;
+  using Base_::CheckRehash;
+public:
+  typedef T mapped_type;
+  typedef typename Base_::value_type value_type;
+  typedef typename Base_::size_type size_type;
+  typedef typename Base_::iterator iterator;
+  typedef typename Base_::const_iterator const_iterator;
+  using Base_::Base_;
+  using Base_::erase;
+
+  template <class It> UnorderedMap(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred(), const Cls& cs = Cls(),
+      const Alloc& alloc = Alloc()) :
+      Base_(std::max<size_t>(4, std::distance(first, last)), hf, eq, cs, alloc) {
+    for (; first != last; first++) base_.InsertIf(*first);
+  }
+
+  T& operator[](const Key& val) { return try_emplace(val).first->second; }
+  T& operator[](Key&& val) { return try_emplace(std::move(val)).first->second; }
+
+  // Bulk load: insert(*it) for each it in [first, last), a random-access
+  // range, with hashing and linking spread over up to `threads` threads (0
+  // means hardware concurrency). The table is grown once up front, and the
+  // first of equal keys wins. Returns how many were inserted.
+  template <class It> size_type insert_parallel(It first, It last, unsigned threads = 0) {
+    return this->InsertParallel(first, last, threads);
+  }
+  // insert(vals[i]) for each i with the prefetching of find_batch; returns
+  // how many were inserted
+  size_type insert_batch(const value_type* vals, size_type n) {
+    size_type ret = 0;
+    base_.ForEachPrefetched(vals, n, [&](size_t i, size_t h) {
+      CheckRehash();
+      ret += base_.InsertIfHashed(vals[i], h).second;
+    });
+    return ret;
+  }
+
+  std::pair<iterator, bool> insert(const value_type& val) {
+    CheckRehash();
+    auto it = base_.InsertIf(val);
+    return std::make_pair(iterator(it.first), it.second);
+  }
+  std::pair<iterator, bool> insert(value_type&& val) {
+    CheckRehash();
+    auto it = base_.InsertIf(std::move(val));
+    return std::make_pair(iterator(it.first), it.second);
+  }
+  // Looks the key up first; only on a miss are the key and T(args...)
+  // constructed in a new node, and args are left untouched on a hit.
+  template <class... Args> std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceIf(key, std::piecewise_construct, std::forward_as_tuple(key),
+                           std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  template <class... Args> std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceIf(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                           std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+  // constructs value_type(args...) in a new node, then looks its key up;
+  // prefer try_emplace when the key is at hand
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceNode(std::forward<Args>(args)...);
+  }
+  // true if inserted, false if an existing value was assigned
+  template <class M> std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    auto it = try_emplace(key, std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+  template <class M> std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+    auto it = try_emplace(std::move(key), std::forward<M>(obj));
+    if (!it.second) it.first->second = std::forward<M>(obj);
+    return it;
+  }
+
+  size_type erase(const Key& val) { return base_.Erase(val); }
+};
+
+template <class Key, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>, class Cls = DefaultClassifier,
+          class Alloc = slab_allocator<Key>, bool kStoreHash = UnorderedStoreHash<Key>::value>
+class UnorderedSet : public UnorderedMapBase_::Table_<Key, Key, Self<Key>,
+    Hash, Pred, Cls, Alloc, kStoreHash, true> {
+  typedef UnorderedMapBase_::Table_<Key, Key, Self<Key>,
+      Hash, Pred, Cls, Alloc, kStoreHash, true> Base_;
+  using Base_::base_;
+  using Base_::CheckRehash;
+public:
+  typedef typename Base_::size_type size_type;
+  typedef typename Base_::iterator iterator;
+  using Base_::Base_;
+  using Base_::erase;
+
+  template <class It> UnorderedSet(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred(), const Cls& cs = Cls(),
+      const Alloc& alloc = Alloc()) :
+      Base_(std::max<size_t>(4, std::distance(first, last)), hf, eq, cs, alloc) {
+    for (; first != last; first++) base_.InsertIf(*first);
+  }
+
+  std::pair<iterator, bool> insert(const Key& val) {
+    CheckRehash();
+    return base_.InsertIf(val);
+  }
+  std::pair<iterator, bool> insert(Key&& val) {
+    CheckRehash();
+    return base_.InsertIf(std::move(val));
+  }
+  // as UnorderedMap::insert_parallel
+  template <class It> size_type insert_parallel(It first, It last, unsigned threads = 0) {
+    return this->InsertParallel(first, last, threads);
+  }
+  template <class... Args> std::pair<iterator, bool> emplace(Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceNode(std::forward<Args>(args)...);
+  }
+  size_type count(const Key& val) const { return base_.Find(val) != base_.ConstIterEnd(); }
+  size_type erase(const Key& val) { return base_.Erase(val); }
+};
+
+// Multi containers keep the nodes of equal keys next to each other in their
+// chain: a new node goes right after the first equal one, and rehashing
+// moves a run without splitting it. find returns the first of the run.
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>, class Cls = DefaultClassifier,
+          class Alloc = slab_allocator<std::pair<const Key, T>>,
+          bool kStoreHash = UnorderedStoreHash<Key>::value>
+class UnorderedMultiMap : public UnorderedMapBase_::Table_<Key, std::pair<const Key, T>,
+    UnorderedMapBase_::First_<Key, T>, Hash, Pred, Cls, Alloc, kStoreHash, false> {
+  typedef UnorderedMapBase_::Table_<Key, std::pair<const Key, T>,
+      UnorderedMapBase_::First_<Key, T>, Hash, Pred, Cls, Alloc, kStoreHash, false> Base_;
+  using Base_::base_;
+  using Base_::CheckRehash;
+public:
+  typedef T mapped_type;
+  typedef typename Base_::value_type value_type;
+  typedef typename Base_::size_type size_type;
+  typedef typename Base_::iterator iterator;
+  typedef typename Base_::const_iterator const_iterator;
+  using Base_::Base_;
+  using Base_::erase;
+
+  template <class It> UnorderedMultiMap(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred(), const Cls& cs = Cls(),
+      const Alloc& alloc = Alloc()) :
+      Base_(std::max<size_t>(4, std::distance(first, last)), hf, eq, cs, alloc) {
+    for (; first != last; first++) base_.EmplaceMulti(*first);
+  }
+
+  iterator insert(const value_type& val) {
+    CheckRehash();
+    return base_.EmplaceMulti(val);
+  }
+  iterator insert(value_type&& val) {
+    CheckRehash();
+    return base_.EmplaceMulti(std::move(val));
+  }
+  template <class... Args> iterator emplace(Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceMulti(std::forward<Args>(args)...);
+  }
+
+  std::pair<iterator, iterator> equal_range(const Key& key) {
+    return this->template EqualRange<iterator>(key);
+  }
+  std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+    return this->template EqualRange<const_iterator>(key);
+  }
+  size_type count(const Key& key) const { return base_.FindRun(key).second; }
+  // erases every element with this key; returns how many
+  size_type erase(const Key& key) { return base_.EraseRun(key); }
+};
+
+template <class Key, class Hash = std::hash<Key>,
+          class Pred = std::equal_to<Key>, class Cls = DefaultClassifier,
+          class Alloc = slab_allocator<Key>, bool kStoreHash = UnorderedStoreHash<Key>::value>
+class UnorderedMultiSet : public UnorderedMapBase_::Table_<Key, Key, Self<Key>,
+    Hash, Pred, Cls, Alloc, kStoreHash, true> {
+  typedef UnorderedMapBase_::Table_<Key, Key, Self<Key>,
+      Hash, Pred, Cls, Alloc, kStoreHash, true> Base_;
+  using Base_::base_;
+  using Base_::CheckRehash;
+public:
+  typedef typename Base_::size_type size_type;
+  typedef typename Base_::iterator iterator;
+  using Base_::Base_;
+  using Base_::erase;
+
+  template <class It> UnorderedMultiSet(It first, It last, size_type bucket = 0,
+      const Hash& hf = Hash(), const Pred& eq = Pred(), const Cls& cs = Cls(),
+      const Alloc& alloc = Alloc()) :
+      Base_(std::max<size_t>(4, std::distance(first, last)), hf, eq, cs, alloc) {
+    for (; first != last; first++) base_.EmplaceMulti(*first);
+  }
+
+  iterator insert(const Key& val) {
+    CheckRehash();
+    return base_.EmplaceMulti(val);
+  }
+  iterator insert(Key&& val) {
+    CheckRehash();
+    return base_.EmplaceMulti(std::move(val));
+  }
+  template <class... Args> iterator emplace(Args&&... args) {
+    CheckRehash();
+    return base_.EmplaceMulti(std::forward<Args>(args)...);
+  }
+
+  std::pair<iterator, iterator> equal_range(const Key& key) const {
+    return this->template EqualRange<iterator>(key);
+  }
+  size_type count(const Key& key) const { return base_.FindRun(key).second; }
+  // erases every element with this key; returns how many
+  size_type erase(const Key& key) { return base_.EraseRun(key); }
 };
 
 #endif